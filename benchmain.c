@@ -0,0 +1,158 @@
+//
+//  main.c
+//  bench
+//
+//  Connection rate benchmark for the server's acceptor workers.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BUFLEN 512
+#define BENCH_PORT 8099
+#define BENCH_CLIENTS 16
+#define BENCH_SECONDS 5
+
+// Calculates time difference, returns result in milliseconds
+long calcTDiff(struct timespec start) {
+    struct timespec end;
+    clock_gettime(CLOCK_REALTIME, &end);
+    return ((end.tv_nsec - start.tv_nsec)/1000000) + ((end.tv_sec - start.tv_sec)*1000);
+}
+
+// One full connection: connect, a cheap query and its reply, disconnect.
+// Returns 0 on success.
+int oneConnection(struct sockaddr_in *Address) {
+    char buffer[BUFLEN] = "profile bench-no-such-progname\n";
+    int ConnectSocket = socket(AF_INET, SOCK_STREAM, 0);
+    
+    if (ConnectSocket < 0) {
+        return -1;
+    }
+    
+    if (connect(ConnectSocket, (struct sockaddr *) Address, sizeof(*Address)) < 0
+        || send(ConnectSocket, buffer, BUFLEN, 0) != BUFLEN
+        || recv(ConnectSocket, buffer, BUFLEN, 0) <= 0) {
+        close(ConnectSocket);
+        return -1;
+    }
+    
+    close(ConnectSocket);
+    return 0;
+}
+
+// Connects in a loop until the time is up and writes the count to resultFd
+void benchClient(int resultFd) {
+    struct sockaddr_in Address = {0};
+    struct timespec start;
+    long completed = 0, failed = 0;
+    
+    Address.sin_family = AF_INET;
+    Address.sin_port = htons(BENCH_PORT);
+    inet_aton("127.0.0.1", &Address.sin_addr);
+    
+    clock_gettime(CLOCK_REALTIME, &start);
+    while (calcTDiff(start) < BENCH_SECONDS * 1000) {
+        if (oneConnection(&Address) == 0) {
+            completed++;
+        } else {
+            failed++;
+        }
+    }
+    
+    long counts[2] = {completed, failed};
+    write(resultFd, counts, sizeof(counts));
+    _exit(0);
+}
+
+// Starts the server with the given number of workers in its own process group
+pid_t startServer(const char *serverPath, int workers) {
+    char port[16], workerArg[16];
+    snprintf(port, sizeof(port), "%d", BENCH_PORT);
+    snprintf(workerArg, sizeof(workerArg), "%d", workers);
+    
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        execl(serverPath, serverPath, "-p", port, "-w", workerArg, (char *) NULL);
+        _exit(127);
+    }
+    
+    // Give the workers time to bind
+    usleep(500000);
+    return pid;
+}
+
+// Measures the connection rate against the server running with workers acceptors
+void benchWorkers(const char *serverPath, int workers) {
+    int resultPipe[2];
+    pid_t server = startServer(serverPath, workers);
+    
+    pid_t clients[BENCH_CLIENTS];
+    
+    fflush(stdout);
+    pipe(resultPipe);
+    for (int i = 0; i < BENCH_CLIENTS; i++) {
+        if ((clients[i] = fork()) == 0) {
+            close(resultPipe[0]);
+            benchClient(resultPipe[1]);
+        }
+    }
+    close(resultPipe[1]);
+    
+    long completed = 0, failed = 0, counts[2];
+    while (read(resultPipe[0], counts, sizeof(counts)) == sizeof(counts)) {
+        completed += counts[0];
+        failed += counts[1];
+    }
+    close(resultPipe[0]);
+    for (int i = 0; i < BENCH_CLIENTS; i++) {
+        waitpid(clients[i], NULL, 0);
+    }
+    
+    printf("workers %-4d %8.1f connections/s (%ld ok, %ld failed)\n",
+           workers, (double) completed / BENCH_SECONDS, completed, failed);
+    
+    kill(-server, SIGTERM);
+    waitpid(server, NULL, 0);
+    usleep(200000);
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc < 2) {
+        printf("usage: %s path-to-server [workers ...]\n", argv[0]);
+        printf("  workers defaults to 1 4 and one per core\n");
+        return 1;
+    }
+    
+    int cores = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%d clients for %ds against %s, %d cores\n", BENCH_CLIENTS, BENCH_SECONDS, argv[1], cores);
+    
+    if (argc == 2) {
+        benchWorkers(argv[1], 1);
+        benchWorkers(argv[1], 4);
+        benchWorkers(argv[1], cores);
+    } else {
+        for (int i = 2; i < argc; i++) {
+            int workers = atoi(argv[i]);
+            benchWorkers(argv[1], workers <= 0 ? cores : workers);
+        }
+    }
+    
+    return 0;
+}
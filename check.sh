@@ -0,0 +1,67 @@
+#!/bin/sh
+# Regression check for the blob store: a program that makes the file it was
+# uploaded with writable and writes to it mustn't change the blob or another
+# progname's copy, and putting the file again puts back what was uploaded.
+# Run with make check, which builds the server and client first.
+
+ROOT=$(cd "$(dirname "$0")" && pwd)
+PORT=${CHECK_PORT:-$((20000 + $$ % 10000))}
+WORK=$(mktemp -d)
+SERVER_PID=
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null
+    fi
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $1"
+    exit 1
+}
+
+mkdir "$WORK/server" "$WORK/files"
+cd "$WORK/files" || exit 1
+echo "original contents" > data.txt
+cat > writer.c <<'EOF'
+#include <stdio.h>
+#include <sys/stat.h>
+int main(void) {
+    // As the file's owner a program can always make it writable
+    chmod("data.txt", 0644);
+    FILE *f = fopen("data.txt", "r+");
+    if (f == NULL) {
+        printf("couldn't open data.txt\n");
+        return 1;
+    }
+    fputs("clobbered", f);
+    fclose(f);
+    printf("wrote to data.txt\n");
+    return 0;
+}
+EOF
+
+cd "$WORK/server" || exit 1
+"$ROOT/server" -p "$PORT" > server.log 2>&1 &
+SERVER_PID=$!
+sleep 1
+
+# With -i the client waits for run's output rather than forking it off and quitting
+cd "$WORK/files" || exit 1
+printf 'put pa writer.c data.txt\nput pb data.txt\nrun pa -i /dev/null\nquit\n' | "$ROOT/client" 127.0.0.1 "$PORT" > client.log 2>&1
+
+grep -q "wrote to data.txt" client.log || fail "the program didn't run"
+grep -q clobbered "$WORK/server/pa/data.txt" || fail "the program's write didn't reach its own copy"
+cmp -s data.txt "$WORK/server/pb/data.txt" || fail "the program changed pb's copy of data.txt"
+
+HASH=$(sha256sum data.txt | cut -c1-64)
+BLOB="$WORK/server/.blobs/$(echo "$HASH" | cut -c1-2)/$HASH"
+[ -f "$BLOB" ] || fail "data.txt isn't in the blob store"
+[ "$(sha256sum "$BLOB" | cut -c1-64)" = "$HASH" ] || fail "the blob no longer matches its hash"
+
+printf 'put pa data.txt -f\nquit\n' | "$ROOT/client" 127.0.0.1 "$PORT" > client.log 2>&1
+cmp -s data.txt "$WORK/server/pa/data.txt" || fail "putting data.txt again didn't restore pa's copy"
+
+echo "PASS: running a program that writes its input left the store and other prognames alone"
@@ -6,6 +6,11 @@
 //  Copyright © 2020 Dante Mattson. All rights reserved.
 //
 
+// Linux only, for splice
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -19,11 +24,337 @@
 #include <time.h>
 #include <stddef.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/un.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <poll.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
-#define PORT 8080
+#define DEFAULT_PORT "8080"
 #define BUFLEN 512
 #define FILEBUFLEN 40960
 
+// Every reply is a run of frames, each a FRAME_HEADER_LEN header then the payload.
+// DATA is the command's output, INFO messages from the server, FD carries a
+// file descriptor (only over unix domain sockets) and END finishes the reply.
+#define FRAME_HEADER_LEN 8
+#define FRAME_DATA 'D'
+#define FRAME_INFO 'I'
+#define FRAME_FD 'F'
+#define FRAME_END 'E'
+
+// A frame the sender compressed: COMPRESS_HEADER_LEN bytes of the original
+// type and length, then the original payload packed with the negotiated codec
+#define FRAME_COMPRESSED 'Z'
+#define COMPRESS_HEADER_LEN 5
+
+// Codecs offered to the server with hello
+#define CODEC_NONE 0
+#define CODEC_LZ 1
+#define CODEC_ZLIB 2
+#define NO_CODECS 3
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+// Chunks under COMPRESS_MIN_LEN go as they are, as do ones that don't shrink by
+// an eighth. After COMPRESS_MAX_MISSES of those in a row only every
+// COMPRESS_RETRY_EVERY'th chunk is tried until one compresses again.
+// Replies are never bigger than COMPRESS_MAX_FRAME unpacked.
+#define COMPRESS_MIN_LEN 256
+#define COMPRESS_MAX_MISSES 4
+#define COMPRESS_RETRY_EVERY 8
+#define COMPRESS_MAX_FRAME (1 << 24)
+
+// get sends the file's validator in a VALIDATOR frame before its content.
+// Sending it back with the next get gets NOT_MODIFIED instead of the content.
+#define FRAME_VALIDATOR 'V'
+#define FRAME_NOT_MODIFIED 'N'
+
+// Sent after VALIDATOR when a get carries on from where an earlier one was cut
+// off, the payload being the offset in decimal that the content starts from
+#define FRAME_RESUME 'R'
+
+// sync sends a file's hash and, past SYNC_BLOCK_MIN bytes, a signature per block:
+// a 4 byte rolling checksum and the first SYNC_STRONG_LEN bytes of the block's SHA-256.
+// Blocks double in size until there are at most SYNC_MAX_BLOCKS.
+#define HASH_LEN 32
+#define HASH_HEX_LEN (2 * HASH_LEN)
+#define SYNC_BLOCK_MIN 2048
+#define SYNC_MAX_BLOCKS 1024
+#define SYNC_STRONG_LEN 16
+#define SYNC_SIG_LEN (4 + SYNC_STRONG_LEN)
+#define SYNC_CHUNK_LEN 65536
+
+// get keeps files it fetched under $HOME/CACHE_DIR/server/progname/
+#define CACHE_DIR ".cache/remote-exec"
+#define CACHE_VALIDATOR_EXT ".validator"
+#define CACHE_PART_EXT ".part"
+
+// When run -f syncs its file to disk, set with -y: never, once at the end, or
+// every so many bytes as well. Progress is shown every FILE_PROGRESS_MS.
+#define FILE_SYNC_NONE -1
+#define FILE_SYNC_END 0
+#define FILE_PROGRESS_MS 250
+
+// put sends the files' contents over up to PutStreams extra connections at once
+// with the blob command when there are at least PUT_PARALLEL_MIN bytes of them
+#define PUT_STREAMS 4
+#define PUT_MAX_STREAMS 16
+#define PUT_PARALLEL_MIN (256 * 1024)
+
+// 1 when connected to the server's unix domain socket
+int LocalConnection = 0;
+
+// Codec the server picked in reply to hello
+int Codec = CODEC_NONE;
+
+// The server as address_port, or the socket path with / as _, naming its cache
+char ServerName[BUFLEN] = "";
+
+// The server as given on the command line, for put to open more connections to
+char ServerAddress[BUFLEN] = "";
+char ServerPort[16] = "";
+
+// Connections put uploads over at once, set with -j
+int PutStreams = PUT_STREAMS;
+
+// Opening a connection, defined with main further down
+int connectServer(const char *serverAddress, const char *port);
+void negotiateCodec(int ConnectSocket, const char *wanted);
+
+// FILE_SYNC_NONE, FILE_SYNC_END or the bytes between syncs
+long FileSyncEvery = FILE_SYNC_NONE;
+
+// Output of run -f on its way to a local file
+struct FileSink {
+    int fd;
+    long written;
+    long unsynced;
+    // errno of the write that failed, after which the rest is only drained
+    int error;
+    struct timespec start;
+    struct timespec shown;
+};
+
+// Compression codecs, the best one both ends have is picked by hello
+const char *codecNames[] = {"none", "lz", "zlib"};
+
+// Reads 4 bytes whatever their alignment
+uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+// Writes an LZ length that didn't fit in its 4 bits of the token as 255s and a remainder
+int lzWriteLength(unsigned char *out, int op, int outCap, int len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= outCap) {
+            return -1;
+        }
+        out[op++] = 255;
+    }
+    if (op >= outCap) {
+        return -1;
+    }
+    out[op++] = (unsigned char) len;
+    return op;
+}
+
+// Writes a sequence: token, literals, then unless it's the last a 2 byte offset and the match length
+int lzWriteSequence(unsigned char *out, int op, int outCap, const unsigned char *literals, int litLen, int offset, int matchLen) {
+    int matchCode = matchLen - LZ_MIN_MATCH;
+    
+    if (op >= outCap) {
+        return -1;
+    }
+    out[op++] = (unsigned char) (((litLen < 15 ? litLen : 15) << 4) | (offset > 0 ? (matchCode < 15 ? matchCode : 15) : 0));
+    if (litLen >= 15 && (op = lzWriteLength(out, op, outCap, litLen - 15)) < 0) {
+        return -1;
+    }
+    if (op + litLen > outCap) {
+        return -1;
+    }
+    memcpy(out + op, literals, litLen);
+    op += litLen;
+    
+    if (offset > 0) {
+        if (op + 2 > outCap) {
+            return -1;
+        }
+        out[op++] = (unsigned char) offset;
+        out[op++] = (unsigned char) (offset >> 8);
+        if (matchCode >= 15 && (op = lzWriteLength(out, op, outCap, matchCode - 15)) < 0) {
+            return -1;
+        }
+    }
+    return op;
+}
+
+// The built in codec, an LZ77 in the style of LZ4: runs of literals and copies from
+// up to 64KB back, found through a hash of every 4 bytes. Returns the compressed
+// length, or -1 if it needs more than outCap bytes.
+int lzCompress(const unsigned char *in, int inLen, unsigned char *out, int outCap) {
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+    
+    memset(table, 0xff, sizeof(table));
+    
+    while (ip + LZ_MIN_MATCH <= inLen) {
+        uint32_t sequence = read32(in + ip);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[hash];
+        table[hash] = ip;
+        
+        if (ref < 0 || ip - ref > 65535 || read32(in + ref) != sequence) {
+            ip++;
+            continue;
+        }
+        
+        int matchLen = LZ_MIN_MATCH;
+        while (ip + matchLen < inLen && in[ref + matchLen] == in[ip + matchLen]) {
+            matchLen++;
+        }
+        
+        op = lzWriteSequence(out, op, outCap, in + anchor, ip - anchor, ip - ref, matchLen);
+        if (op < 0) {
+            return -1;
+        }
+        ip += matchLen;
+        anchor = ip;
+    }
+    
+    // Always ends with a sequence of just literals, maybe none
+    return lzWriteSequence(out, op, outCap, in + anchor, inLen - anchor, 0, 0);
+}
+
+// Reads an extended LZ length, -1 if it runs off the end of the input
+int lzReadLength(const unsigned char *in, int inLen, int *ip) {
+    int len = 0;
+    unsigned char byte;
+    do {
+        if (*ip >= inLen) {
+            return -1;
+        }
+        byte = in[(*ip)++];
+        len += byte;
+    } while (byte == 255);
+    return len;
+}
+
+// Returns the decompressed length, or -1 if the input is corrupt or won't fit in outCap
+int lzDecompress(const unsigned char *in, int inLen, unsigned char *out, int outCap) {
+    int ip = 0, op = 0;
+    
+    while (ip < inLen) {
+        int token = in[ip++];
+        int litLen = token >> 4;
+        if (litLen == 15) {
+            int extra = lzReadLength(in, inLen, &ip);
+            if (extra < 0) {
+                return -1;
+            }
+            litLen += extra;
+        }
+        if (ip + litLen > inLen || op + litLen > outCap) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, litLen);
+        ip += litLen;
+        op += litLen;
+        
+        // The last sequence has no match
+        if (ip >= inLen) {
+            break;
+        }
+        
+        if (ip + 2 > inLen) {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int matchLen = token & 15;
+        if (matchLen == 15) {
+            int extra = lzReadLength(in, inLen, &ip);
+            if (extra < 0) {
+                return -1;
+            }
+            matchLen += extra;
+        }
+        matchLen += LZ_MIN_MATCH;
+        
+        if (offset == 0 || offset > op || op + matchLen > outCap) {
+            return -1;
+        }
+        // Byte at a time as the copy can overlap what it's writing
+        for (int i = 0; i < matchLen; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+    
+    return op;
+}
+
+// Compresses with codec, returns the length or -1 if it doesn't fit in outCap
+int compressChunk(int codec, const unsigned char *in, int inLen, unsigned char *out, int outCap) {
+    if (codec == CODEC_LZ) {
+        return lzCompress(in, inLen, out, outCap);
+    }
+#ifdef HAVE_ZLIB
+    if (codec == CODEC_ZLIB) {
+        uLongf outLen = outCap;
+        return compress2(out, &outLen, in, inLen, 1) == Z_OK ? (int) outLen : -1;
+    }
+#endif
+    return -1;
+}
+
+// Decompresses with codec, returns the length or -1 if the data is bad
+int decompressChunk(int codec, const unsigned char *in, int inLen, unsigned char *out, int outCap) {
+    if (codec == CODEC_LZ) {
+        return lzDecompress(in, inLen, out, outCap);
+    }
+#ifdef HAVE_ZLIB
+    if (codec == CODEC_ZLIB) {
+        uLongf outLen = outCap;
+        return uncompress(out, &outLen, in, inLen) == Z_OK ? (int) outLen : -1;
+    }
+#endif
+    return -1;
+}
+
+// Packs a chunk of type into out as the payload of a COMPRESSED frame.
+// Returns the payload length, or 0 to send the chunk as it is.
+int packChunk(int type, const unsigned char *data, int len, unsigned char *out) {
+    static int misses = 0;
+    
+    if (Codec == CODEC_NONE || len < COMPRESS_MIN_LEN) {
+        return 0;
+    }
+    // Mostly incompressible so far, only try now and then
+    if (misses >= COMPRESS_MAX_MISSES && misses++ % COMPRESS_RETRY_EVERY != 0) {
+        return 0;
+    }
+    
+    // Not worth it unless it saves an eighth
+    int packed = compressChunk(Codec, data, len, out + COMPRESS_HEADER_LEN, len - len / 8 - COMPRESS_HEADER_LEN);
+    if (packed < 0) {
+        misses++;
+        return 0;
+    }
+    
+    uint32_t originalLen = htonl(len);
+    out[0] = (unsigned char) type;
+    memcpy(out + 1, &originalLen, 4);
+    misses = 0;
+    return packed + COMPRESS_HEADER_LEN;
+}
+
 // Zombie termination
 void sig_child(int signum) {
     pid_t pid;
@@ -71,22 +402,279 @@ void sendToServer(int ConnectSocket, char *buffer, int buflen)
     }
 }
 
-// Receives messages from the client and handles errors
-char* receive(int ConnectSocket, int iResult, char *recvbuf, int recvbuflen) {
+// Receives exactly len bytes and handles errors. On a local connection a
+// file descriptor passed along with them is stored in fd, which is otherwise -1.
+// Returns 0, or -1 if the connection is gone.
+int receiveAll(int ConnectSocket, char *recvbuf, size_t len, int *fd) {
+    struct msghdr msg = {0};
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    size_t received = 0;
+    
+    *fd = -1;
+    
+    while (received < len) {
+        iov.iov_base = recvbuf + received;
+        iov.iov_len = len - received;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = LocalConnection ? control : NULL;
+        msg.msg_controllen = LocalConnection ? sizeof(control) : 0;
+        
+        int iResult = (int) recvmsg(ConnectSocket, &msg, 0);
+        if (iResult == 0) {
+            printf("Connection Closed\n");
+            return -1;
+        } else if (iResult < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Receive Failed with error\n");
+            return -1;
+        }
+        
+        struct cmsghdr *cmsg = LocalConnection ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+        
+        received += iResult;
+    }
+    
+    return 0;
+}
+
+// Receives the len byte payload of a COMPRESSED frame and unpacks up to
+// recvbuflen bytes of it into recvbuf. Returns as receiveFrame.
+int receiveCompressed(int ConnectSocket, int *type, char *recvbuf, int recvbuflen, uint32_t len) {
+    unsigned char *packed = malloc(len + 1);
+    uint32_t originalLen;
+    int unusedFd;
+    
+    if (packed == NULL || len < COMPRESS_HEADER_LEN || receiveAll(ConnectSocket, (char *) packed, len, &unusedFd) < 0) {
+        free(packed);
+        *type = FRAME_END;
+        return -1;
+    }
+    
+    int originalType = packed[0];
+    memcpy(&originalLen, packed + 1, 4);
+    originalLen = ntohl(originalLen);
+    unsigned char *unpacked = originalLen <= COMPRESS_MAX_FRAME ? malloc(originalLen + 1) : NULL;
+    int unpackedLen = unpacked != NULL ? decompressChunk(Codec, packed + COMPRESS_HEADER_LEN, (int) len - COMPRESS_HEADER_LEN, unpacked, (int) originalLen) : -1;
+    free(packed);
+    
+    if (unpackedLen != (int) originalLen) {
+        printf("Corrupt compressed reply from server\n");
+        free(unpacked);
+        *type = FRAME_END;
+        return -1;
+    }
+    
+    *type = originalType;
+    int keep = unpackedLen < recvbuflen ? unpackedLen : recvbuflen;
+    memcpy(recvbuf, unpacked, keep);
+    free(unpacked);
+    return keep;
+}
+
+// Receives the next frame of a reply, its payload going into recvbuf which holds
+// up to recvbuflen bytes. Returns the payload length with the frame's type in
+// type, or -1 if the connection is gone. fd is as for receiveAll.
+int receiveFrame(int ConnectSocket, int *type, char *recvbuf, int recvbuflen, int *fd) {
+    char header[FRAME_HEADER_LEN];
+    uint32_t fields[2];
+    int unusedFd;
     
-    iResult = (int) recv(ConnectSocket, recvbuf, recvbuflen, 0);
-    if (iResult > 0){
-        printf("Bytes Received: %d\n", iResult);
-        return recvbuf;
+    if (receiveAll(ConnectSocket, header, FRAME_HEADER_LEN, fd) < 0) {
+        *type = FRAME_END;
+        return -1;
     }
-    else if (iResult == 0){
-        printf("Connection Closed\n");
+    memcpy(fields, header, FRAME_HEADER_LEN);
+    *type = (int) ntohl(fields[0]);
+    uint32_t len = ntohl(fields[1]);
+    
+    if (*type == FRAME_COMPRESSED) {
+        return receiveCompressed(ConnectSocket, type, recvbuf, recvbuflen, len);
+    }
+    
+    // Payloads are never bigger than the buffers here, but don't get out of step if one is
+    uint32_t keep = len < (uint32_t) recvbuflen ? len : (uint32_t) recvbuflen;
+    if (receiveAll(ConnectSocket, recvbuf, keep, &unusedFd) < 0) {
+        *type = FRAME_END;
+        return -1;
     }
-    else if (iResult == -1) {
-        perror("Receive Failed with error\n");
+    for (uint32_t skipped = keep; skipped < len; ) {
+        char discard[BUFLEN];
+        uint32_t n = len - skipped < BUFLEN ? len - skipped : BUFLEN;
+        if (receiveAll(ConnectSocket, discard, n, &unusedFd) < 0) {
+            *type = FRAME_END;
+            return -1;
+        }
+        skipped += n;
     }
     
-    return "Unable to read\n";
+    return (int) keep;
+}
+
+// Prints a whole reply
+void printResponse(int ConnectSocket) {
+    char recvbuf[FILEBUFLEN];
+    int type, fd, len;
+    
+    printf("\n--- Response --- \n");
+    while ((len = receiveFrame(ConnectSocket, &type, recvbuf, FILEBUFLEN, &fd)) >= 0 && type != FRAME_END) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fwrite(recvbuf, 1, len, stdout);
+    }
+    printf("\n");
+}
+
+// Collects a whole reply as a string in recvbuf
+char* receiveText(int ConnectSocket, char *recvbuf, int recvbuflen) {
+    int type, fd, len, used = 0;
+    char frame[FILEBUFLEN];
+    
+    recvbuf[0] = '\0';
+    while ((len = receiveFrame(ConnectSocket, &type, frame, FILEBUFLEN, &fd)) >= 0 && type != FRAME_END) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (len > recvbuflen - used - 1) {
+            len = recvbuflen - used - 1;
+        }
+        memcpy(recvbuf + used, frame, len);
+        used += len;
+        recvbuf[used] = '\0';
+    }
+    
+    return recvbuf;
+}
+
+// Milliseconds since start
+long msSince(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+void sinkOpen(struct FileSink *sink, int fd) {
+    memset(sink, 0, sizeof(struct FileSink));
+    sink->fd = fd;
+    clock_gettime(CLOCK_MONOTONIC, &sink->start);
+    sink->shown = sink->start;
+}
+
+void sinkSync(struct FileSink *sink) {
+#ifdef __linux__
+    fdatasync(sink->fd);
+#else
+    fsync(sink->fd);
+#endif
+    sink->unsynced = 0;
+}
+
+// Counts len more bytes written, syncing and showing progress as they're due
+void sinkWritten(struct FileSink *sink, long len) {
+    sink->written += len;
+    sink->unsynced += len;
+    
+    if (FileSyncEvery > 0 && sink->unsynced >= FileSyncEvery) {
+        sinkSync(sink);
+    }
+    
+    // Progress goes on one line that's rewritten, only on a terminal
+    if (isatty(STDERR_FILENO) && msSince(&sink->shown) >= FILE_PROGRESS_MS) {
+        long ms = msSince(&sink->start);
+        fprintf(stderr, "\r%ld bytes written, %.1f MB/s   ", sink->written, ms > 0 ? sink->written / 1000.0 / ms : 0.0);
+        clock_gettime(CLOCK_MONOTONIC, &sink->shown);
+    }
+}
+
+// Writes all of buf to the file, picking up after short writes
+void sinkWrite(struct FileSink *sink, const char *buf, long len) {
+    while (len > 0 && sink->error == 0) {
+        ssize_t n = write(sink->fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            sink->error = n < 0 ? errno : EIO;
+            return;
+        }
+        buf += n;
+        len -= n;
+        sinkWritten(sink, n);
+    }
+}
+
+// Copies a pipe the server passed over to the file until EOF.
+// On linux it's spliced so the data never passes through the client.
+void sinkCopyFd(struct FileSink *sink, int fd) {
+    char buffer[FILEBUFLEN];
+    ssize_t bytesRead;
+    
+#ifdef __linux__
+    ssize_t spliced;
+    while (sink->error == 0 && (spliced = splice(fd, NULL, sink->fd, NULL, FILEBUFLEN, SPLICE_F_MOVE)) > 0) {
+        sinkWritten(sink, spliced);
+    }
+    if (sink->error == 0 && spliced == 0) {
+        return;
+    }
+#endif
+    
+    // Not a pipe or no splice, copy it over
+    while ((bytesRead = read(fd, buffer, FILEBUFLEN)) > 0) {
+        sinkWrite(sink, buffer, bytesRead);
+    }
+}
+
+// Finishes the file, reporting how much went into it and how fast.
+// complete is 0 if the connection went before the end of the output.
+void sinkClose(struct FileSink *sink, const char *fileName, int complete) {
+    struct stat st;
+    
+    if (FileSyncEvery != FILE_SYNC_NONE && sink->error == 0) {
+        sinkSync(sink);
+    }
+    if (isatty(STDERR_FILENO) && sink->written > 0) {
+        fprintf(stderr, "\r%*s\r", 40, "");
+    }
+    
+    long ms = msSince(&sink->start);
+    if (sink->error != 0) {
+        printf("Writing %s failed after %ld bytes: %s\n", fileName, sink->written, strerror(sink->error));
+    } else if (fstat(sink->fd, &st) == 0 && st.st_size != sink->written) {
+        printf("%s is %ld bytes but %ld were written\n", fileName, (long) st.st_size, sink->written);
+    } else {
+        printf("Wrote %ld bytes to %s in %ldms (%.1f MB/s)%s\n", sink->written, fileName, ms,
+               ms > 0 ? sink->written / 1000.0 / ms : 0.0, complete ? "" : ", incomplete as the connection was lost");
+    }
+    close(sink->fd);
+}
+
+
+// Prints len bytes of buf, pausing every 40 lines.
+// numLines carries the count over between calls.
+void pageOutput(const char *buf, int len, int *numLines) {
+    for (int i = 0; i < len; i++) {
+        if ((int)buf[i] == 10) {
+            *numLines += 1;
+            
+            if (*numLines % 40 != 0) {
+                printf("%c", buf[i]);
+            } else {
+                printf("\n---");
+                getchar();
+            }
+            
+        } else {
+            printf("%c", buf[i]);
+        }
+    }
 }
 
 // 1 = file, 0 = dir
@@ -96,80 +684,943 @@ int isFileOrDir(const char *path) {
     return S_ISREG(path_stat.st_mode);
 }
 
-// Runs the put command, reads and uploads files to the server
+// SHA-256, used to tell the server what our files hold
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t len;
+    unsigned char block[64];
+    size_t used;
+};
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256Init(struct Sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->len = 0;
+    ctx->used = 0;
+}
+
+void sha256Block(struct Sha256 *ctx, const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t s[8];
+    
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16) | ((uint32_t) block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    memcpy(s, ctx->state, sizeof(s));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = s[7] + (ROTR32(s[4], 6) ^ ROTR32(s[4], 11) ^ ROTR32(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256K[i] + w[i];
+        uint32_t t2 = (ROTR32(s[0], 2) ^ ROTR32(s[0], 13) ^ ROTR32(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) {
+        ctx->state[i] += s[i];
+    }
+}
+
+void sha256Update(struct Sha256 *ctx, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    ctx->len += len;
+    
+    while (len > 0) {
+        size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, bytes, n);
+        ctx->used += n;
+        bytes += n;
+        len -= n;
+        
+        if (ctx->used == 64) {
+            sha256Block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256Final(struct Sha256 *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->len * 8;
+    unsigned char pad = 0x80;
+    
+    sha256Update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) {
+        sha256Update(ctx, &pad, 1);
+    }
+    for (int i = 7; i >= 0; i--) {
+        unsigned char byte = (unsigned char) (bits >> (8 * i));
+        sha256Update(ctx, &byte, 1);
+    }
+    
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char) (ctx->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char) (ctx->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char) (ctx->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char) ctx->state[i];
+    }
+}
+
+// Hashes len bytes of data in one go
+void sha256(const void *data, size_t len, unsigned char *digest) {
+    struct Sha256 ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, data, len);
+    sha256Final(&ctx, digest);
+}
+
+// Writes a digest as HASH_HEX_LEN hex characters and a NUL
+void hashToHex(const unsigned char *digest, char *hex) {
+    for (int i = 0; i < HASH_LEN; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+// rsync's rolling checksum of a block, two 16 bit sums
+uint32_t weakChecksum(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t) (len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Sends a frame: type and length in network order then the payload.
+// Uploaded data is compressed if a codec was negotiated and it shrinks.
+void sendFrame(int ConnectSocket, int type, const void *data, uint32_t len) {
+    unsigned char *packed = NULL;
+    
+    if (Codec != CODEC_NONE && type == FRAME_DATA && len >= COMPRESS_MIN_LEN) {
+        packed = malloc(len);
+        int packedLen = packed != NULL ? packChunk(type, data, (int) len, packed) : 0;
+        if (packedLen > 0) {
+            type = FRAME_COMPRESSED;
+            data = packed;
+            len = packedLen;
+        }
+    }
+    
+    uint32_t fields[2] = {htonl(type), htonl(len)};
+    sendToServer(ConnectSocket, (char *) fields, FRAME_HEADER_LEN);
+    
+    // send may take less than the whole payload
+    for (uint32_t sent = 0; sent < len; ) {
+        ssize_t n = send(ConnectSocket, (const char *) data + sent, len - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send failed with error:");
+            close(ConnectSocket);
+            exit(1);
+        }
+        sent += n;
+    }
+    free(packed);
+}
+
+// Reads all of path into a malloc'd buffer, NULL if it can't be read
+unsigned char *readWholeFile(const char *path, long *size) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || S_ISREG(st.st_mode) == 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    // One spare byte so that empty files still get a buffer
+    unsigned char *data = malloc(st.st_size + 1);
+    long total = 0;
+    while (data != NULL && total < st.st_size) {
+        ssize_t n = read(fd, data + total, st.st_size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+    
+    *size = total;
+    return data;
+}
+
+// Maps all of path into memory, NULL if it can't be read. Unmap it with unmapFile.
+unsigned char *mapFile(const char *path, long *size) {
+    static unsigned char empty[1];
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || S_ISREG(st.st_mode) == 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    *size = (long) st.st_size;
+    if (st.st_size == 0) {
+        close(fd);
+        return empty;
+    }
+    
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    // Read front to back, once
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    return data;
+}
+
+void unmapFile(unsigned char *data, long size) {
+    if (data != NULL && size > 0) {
+        munmap(data, size);
+    }
+}
+
+// Sends a file's manifest: "size blockLen noBlocks hash", then for files
+// over SYNC_BLOCK_MIN the rolling checksum and strong hash of every block
+void sendManifest(int ConnectSocket, const unsigned char *data, long size) {
+    unsigned char digest[HASH_LEN];
+    char hex[HASH_HEX_LEN + 1];
+    char header[BUFLEN];
+    long blockLen = SYNC_BLOCK_MIN;
+    int noBlocks = 0;
+    
+    if (size > SYNC_BLOCK_MIN) {
+        while ((size + blockLen - 1) / blockLen > SYNC_MAX_BLOCKS) {
+            blockLen *= 2;
+        }
+        noBlocks = (int) ((size + blockLen - 1) / blockLen);
+    }
+    
+    sha256(data, size, digest);
+    hashToHex(digest, hex);
+    int len = snprintf(header, BUFLEN, "%ld %ld %d %s", size, blockLen, noBlocks, hex);
+    sendFrame(ConnectSocket, FRAME_INFO, header, len);
+    
+    if (noBlocks > 0) {
+        unsigned char *sigs = malloc(noBlocks * SYNC_SIG_LEN);
+        for (int i = 0; i < noBlocks; i++) {
+            long offset = i * blockLen;
+            long n = size - offset < blockLen ? size - offset : blockLen;
+            uint32_t weak = htonl(weakChecksum(data + offset, n));
+            
+            sha256(data + offset, n, digest);
+            memcpy(sigs + i * SYNC_SIG_LEN, &weak, 4);
+            memcpy(sigs + i * SYNC_SIG_LEN + 4, digest, SYNC_STRONG_LEN);
+        }
+        sendFrame(ConnectSocket, FRAME_DATA, sigs, noBlocks * SYNC_SIG_LEN);
+        free(sigs);
+    }
+}
+
+// Sends what the server asked for of a file. plan is its line of the server's
+// reply: "same" or "have" for nothing, "all", "resume" with how much it already
+// has, or "need" with a hex digit per four blocks saying which it lacks.
+void sendSyncData(int ConnectSocket, const char *plan, const unsigned char *data, long size) {
+    long start = 0;
+    
+    if (strncmp(plan, "resume ", 7) == 0) {
+        // The server kept the first part of an upload that was cut off, carry on
+        // after it if it hashes the same as the start of our file
+        char serverHash[HASH_HEX_LEN + 1] = {0, };
+        char hex[HASH_HEX_LEN + 1];
+        unsigned char digest[HASH_LEN];
+        char from[64];
+        long offset = -1;
+        
+        if (sscanf(plan + 7, "%ld %64s", &offset, serverHash) == 2 && offset > 0 && offset <= size) {
+            sha256(data, offset, digest);
+            hashToHex(digest, hex);
+            if (strcmp(hex, serverHash) == 0) {
+                start = offset;
+                printf("Resuming upload at %ld of %ld bytes\n", start, size);
+            }
+        }
+        
+        int len = snprintf(from, sizeof(from), "from %ld", start);
+        sendFrame(ConnectSocket, FRAME_INFO, from, len);
+    }
+    
+    if (strncmp(plan, "all", 3) == 0 || strncmp(plan, "resume ", 7) == 0) {
+        for (long offset = start; offset < size; offset += SYNC_CHUNK_LEN) {
+            long n = size - offset < SYNC_CHUNK_LEN ? size - offset : SYNC_CHUNK_LEN;
+            sendFrame(ConnectSocket, FRAME_DATA, data + offset, (uint32_t) n);
+        }
+        sendFrame(ConnectSocket, FRAME_END, NULL, 0);
+        
+    } else if (strncmp(plan, "need ", 5) == 0) {
+        // Block size as worked out in sendManifest
+        long blockLen = SYNC_BLOCK_MIN;
+        while ((size + blockLen - 1) / blockLen > SYNC_MAX_BLOCKS) {
+            blockLen *= 2;
+        }
+        
+        const char *bitmap = plan + 5;
+        for (int i = 0; bitmap[i / 4] != '\0' && bitmap[i / 4] != '\n'; i++) {
+            char digit[2] = {bitmap[i / 4], '\0'};
+            long offset = i * blockLen;
+            
+            if ((strtol(digit, NULL, 16) & (1 << (i % 4))) && offset < size) {
+                long n = size - offset < blockLen ? size - offset : blockLen;
+                sendFrame(ConnectSocket, FRAME_DATA, data + offset, (uint32_t) n);
+            }
+        }
+        sendFrame(ConnectSocket, FRAME_END, NULL, 0);
+    }
+}
+
+// Runs the sync command, uploading only the files and blocks the server doesn't already have
+void syncFiles(int ConnectSocket, char *inputCopy, int inputSize, char **commands, int k) {
+    int noFiles = k - 2;
+    unsigned char *files[64] = {0, };
+    long sizes[64] = {0, };
+    
+    if (noFiles < 1) {
+        printf("sync usage: \"sync progname sourcefile[s]\"\n");
+        return;
+    }
+    
+    for (int i = 0; i < noFiles; i++) {
+        files[i] = readWholeFile(commands[i + 2], &sizes[i]);
+        if (files[i] == NULL) {
+            perror(commands[i + 2]);
+            printf("Unable to find one or more of the input files.\n");
+            for (int j = 0; j < i; j++) {
+                free(files[j]);
+            }
+            return;
+        }
+    }
+    
+    sendToServer(ConnectSocket, inputCopy, inputSize);
+    for (int i = 0; i < noFiles; i++) {
+        sendManifest(ConnectSocket, files[i], sizes[i]);
+    }
+    
+    // "ok" then a line per file, or an error
+    char *plan = malloc(FILEBUFLEN);
+    receiveText(ConnectSocket, plan, FILEBUFLEN);
+    
+    if (strncmp(plan, "ok\n", 3) == 0) {
+        char *line = plan + 3;
+        for (int i = 0; i < noFiles && line != NULL; i++) {
+            sendSyncData(ConnectSocket, line, files[i], sizes[i]);
+            line = strchr(line, '\n');
+            if (line != NULL) {
+                line++;
+            }
+        }
+        printResponse(ConnectSocket);
+    } else {
+        printf("\n--- Response --- \n%s\n", plan);
+    }
+    
+    free(plan);
+    for (int i = 0; i < noFiles; i++) {
+        free(files[i]);
+    }
+}
+
+// Stores one file's content on the server with the blob command.
+// Returns the bytes sent, or -1 if the server couldn't store it.
+long sendBlob(int ConnectSocket, const unsigned char *data, long size, const char *hash) {
+    char command[BUFLEN] = {0, };
+    char reply[BUFLEN] = {0, };
+    
+    snprintf(command, BUFLEN, "blob %s %ld", hash, size);
+    sendToServer(ConnectSocket, command, BUFLEN);
+    
+    // "have", "all" or "resume offset hash", the same as for put
+    receiveText(ConnectSocket, reply, BUFLEN);
+    if (strncmp(reply, "have", 4) == 0) {
+        return 0;
+    }
+    if (strncmp(reply, "all", 3) != 0 && strncmp(reply, "resume ", 7) != 0) {
+        return -1;
+    }
+    sendSyncData(ConnectSocket, reply, data, size);
+    
+    receiveText(ConnectSocket, reply, BUFLEN);
+    return strncmp(reply, "stored ", 7) == 0 ? atol(reply + 7) : -1;
+}
+
+// What each upload connection did, sent back to put over a pipe
+struct UploadResult {
+    int files;
+    int failed;
+    long bytes;
+};
+
+// Stores the files on the server over up to PutStreams more connections at once,
+// each a child process with its own share, the biggest files spread out first
+void uploadParallel(unsigned char **files, long *sizes, char hashes[][HASH_HEX_LEN + 1], int noFiles) {
+    int streams = noFiles < PutStreams ? noFiles : PutStreams;
+    int order[64], assigned[64];
+    long load[PUT_MAX_STREAMS] = {0, };
+    struct UploadResult total = {0, 0, 0}, result;
+    struct timespec start;
+    int results[2];
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // Biggest first, each to the connection with the least to send so far
+    for (int i = 0; i < noFiles; i++) {
+        int j = i;
+        for (; j > 0 && sizes[order[j - 1]] < sizes[i]; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    for (int i = 0; i < noFiles; i++) {
+        int least = 0;
+        for (int s = 1; s < streams; s++) {
+            if (load[s] < load[least]) {
+                least = s;
+            }
+        }
+        assigned[order[i]] = least;
+        load[least] += sizes[order[i]];
+    }
+    
+    if (pipe(results) < 0) {
+        perror("Unable to upload in parallel");
+        return;
+    }
+    
+    for (int s = 0; s < streams; s++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            struct UploadResult mine = {0, 0, 0};
+            close(results[0]);
+            
+            int sock = connectServer(ServerAddress, ServerPort);
+            if (Codec != CODEC_NONE) {
+                negotiateCodec(sock, codecNames[Codec]);
+            }
+            for (int i = 0; i < noFiles; i++) {
+                if (assigned[i] != s) {
+                    continue;
+                }
+                long sent = sendBlob(sock, files[i], sizes[i], hashes[i]);
+                if (sent < 0) {
+                    mine.failed++;
+                } else {
+                    mine.files++;
+                    mine.bytes += sent;
+                }
+            }
+            
+            // Small enough to go in one piece whoever else is writing
+            write(results[1], &mine, sizeof(mine));
+            close(sock);
+            _exit(0);
+        } else if (pid < 0) {
+            perror("Upload fork failed with error");
+        }
+    }
+    close(results[1]);
+    
+    // Until every child is done with its end of the pipe
+    while (read(results[0], &result, sizeof(result)) == sizeof(result)) {
+        total.files += result.files;
+        total.failed += result.failed;
+        total.bytes += result.bytes;
+    }
+    close(results[0]);
+    
+    long ms = msSince(&start);
+    printf("Uploaded %d of %d files, %ld bytes over %d connections in %ldms (%.1f MB/s)\n", total.files, noFiles,
+           total.bytes, streams, ms, ms > 0 ? total.bytes / 1000.0 / ms : 0.0);
+}
+
+// Runs the put command, reads and uploads files to the server.
+// Only files the server doesn't already hold the content of are sent.
 void put(int ConnectSocket, char *inputCopy, int inputSize, char **commands, int k) {
     // check files exist before sending request
     // -1 for put, -1 for dirname
     int filesExpectedToSend = k - 2;
-    int shouldOverride = 0;
     if (strcmp(commands[k - 1], "-f") == 0) {
         // -1 for -f
-        shouldOverride = 1;
         filesExpectedToSend -= 1;
     }
-    FILE *fileRead;
+    unsigned char *files[64] = {0, };
+    long sizes[64] = {0, };
+    char hashes[64][HASH_HEX_LEN + 1];
     int fileExistsCount = 0;
+    long totalSize = 0;
     
     // Check all the files
     for (int i = 2; i < 2 + filesExpectedToSend; i++) {
         printf("reading file: %s\n", commands[i]);
-        fileRead = fopen(commands[i], "r");
-        if (fileRead == NULL) {
+        files[i - 2] = mapFile(commands[i], &sizes[i - 2]);
+        if (files[i - 2] == NULL) {
             perror("file could not be read...\n");
         } else {
             fileExistsCount += 1;
+            totalSize += sizes[i - 2];
         }
     }
     
     if (fileExistsCount != filesExpectedToSend) {
         printf("Unable to find one or more of the input files.\n");
+        for (int i = 0; i < filesExpectedToSend; i++) {
+            unmapFile(files[i], sizes[i]);
+        }
         return;
     }
     
-    // Handshake
+    for (int i = 0; i < filesExpectedToSend; i++) {
+        unsigned char digest[HASH_LEN];
+        sha256(files[i], sizes[i], digest);
+        hashToHex(digest, hashes[i]);
+    }
+    
+    // Big sets of files go up in parallel first, put then finds them on the server
+    // and only has to link them. Anything that didn't make it goes the usual way.
+    if (PutStreams > 1 && filesExpectedToSend > 1 && totalSize >= PUT_PARALLEL_MIN) {
+        uploadParallel(files, sizes, hashes, filesExpectedToSend);
+    }
+    
+    // Handshake, the command then "size hash" for each file
     sendToServer(ConnectSocket, inputCopy, inputSize);
-    char recvbuf[BUFLEN] = {0,};
-    int iResult = 0;
-    printf("\n--- Response --- \n%s\n", receive(ConnectSocket, iResult, recvbuf, BUFLEN));
-    memset(recvbuf, 0, BUFLEN);
-    receive(ConnectSocket, iResult, recvbuf, BUFLEN);
-    
-    // ok -- Handshake successful
-    if (recvbuf[0] == 'o') {
-        char fileReadBuffer[FILEBUFLEN] = {0, };
+    for (int i = 0; i < filesExpectedToSend; i++) {
+        char manifest[BUFLEN];
+        int len = snprintf(manifest, BUFLEN, "%ld %s", sizes[i], hashes[i]);
+        sendFrame(ConnectSocket, FRAME_INFO, manifest, len);
+    }
+    
+    char recvbuf[FILEBUFLEN] = {0,};
+    printf("\n--- Response --- \n%s\n", receiveText(ConnectSocket, recvbuf, BUFLEN));
+    receiveText(ConnectSocket, recvbuf, FILEBUFLEN);
+    
+    // ok -- Handshake successful, then "have" or "all" for each file
+    if (strncmp(recvbuf, "ok\n", 3) == 0) {
+        char *line = recvbuf + 3;
         
-        for (int i = 2; i < 2 + filesExpectedToSend; i++) {
-            printf("reading file: %s\n", commands[i]);
-            fileRead = fopen(commands[i], "r");
-            if (fileRead == NULL) {
-                perror("file could not be read...\n");
+        for (int i = 0; i < filesExpectedToSend && line != NULL; i++) {
+            sendSyncData(ConnectSocket, line, files[i], sizes[i]);
+            line = strchr(line, '\n');
+            if (line != NULL) {
+                line++;
             }
-            fread(fileReadBuffer, FILEBUFLEN, 1, fileRead);
-            sendToServer(ConnectSocket, fileReadBuffer, FILEBUFLEN);
-            memset(fileReadBuffer, 0, FILEBUFLEN);
         }
         
-        receive(ConnectSocket, iResult, recvbuf, BUFLEN);
-        printf("\n--- Response --- \n%s\n", recvbuf);
+        printResponse(ConnectSocket);
         
     } else {
         // Error handling
         printf("\n--- Response --- \n%s\n", recvbuf);
     }
     
+    for (int i = 0; i < filesExpectedToSend; i++) {
+        unmapFile(files[i], sizes[i]);
+    }
+    
     return;
     
 }
 
+// Where get keeps its copy of progname/file from this server. The validator
+// the server gave for it is kept alongside in the same name plus CACHE_VALIDATOR_EXT.
+// 1 if name is relative and none of its components are empty or start with a
+// dot, so it can't lead out of the directory it's put under
+int isSafeName(const char *name) {
+    for (const char *part = name; part != NULL; part = strchr(part, '/')) {
+        if (*part == '/') {
+            part++;
+        }
+        if (*part == '.' || *part == '/' || *part == '\0') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Sets path to where get caches progname's file, 0 if the names aren't safe
+// to put under the cache directory and it shouldn't be cached at all
+int cachePath(const char *progname, const char *file, char *path, int len) {
+    const char *home = getenv("HOME");
+    if (!isSafeName(progname) || !isSafeName(file)) {
+        return 0;
+    }
+    snprintf(path, len, "%s/%s/%s/%s/%s", home != NULL ? home : ".", CACHE_DIR, ServerName, progname, file);
+    return 1;
+}
+
+// Creates every missing directory above path
+void makeParentDirs(const char *path) {
+    char dir[BUFLEN];
+    snprintf(dir, BUFLEN, "%s", path);
+    
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
+    }
+}
+
+// Reads the validator saved with a cached file, returns 0 if there's no usable copy
+int readCacheValidator(const char *path, char *validator, int len) {
+    char validatorPath[BUFLEN];
+    snprintf(validatorPath, BUFLEN, "%s%s", path, CACHE_VALIDATOR_EXT);
+    
+    FILE *fp = fopen(validatorPath, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    int ok = fgets(validator, len, fp) != NULL;
+    fclose(fp);
+    validator[strcspn(validator, " \n")] = '\0';
+    
+    return ok && validator[0] != '\0' && access(path, R_OK) == 0;
+}
+
+void writeCacheValidator(const char *path, const char *validator) {
+    char validatorPath[BUFLEN];
+    snprintf(validatorPath, BUFLEN, "%s%s", path, CACHE_VALIDATOR_EXT);
+    
+    FILE *fp = fopen(validatorPath, "w");
+    if (fp != NULL) {
+        fprintf(fp, "%s\n", validator);
+        fclose(fp);
+    }
+}
+
+// Pages the whole of fd, writing it to cacheFd as well if that isn't -1
+void pageFd(int fd, int cacheFd, int *numLines) {
+    char buffer[FILEBUFLEN];
+    ssize_t bytesRead;
+    
+    while ((bytesRead = read(fd, buffer, FILEBUFLEN)) > 0) {
+        if (cacheFd >= 0) {
+            write(cacheFd, buffer, bytesRead);
+        }
+        pageOutput(buffer, (int) bytesRead, numLines);
+    }
+}
+
+// Hashes the whole of path, returning its length or -1 if it can't be read
+long hashFile(const char *path, char *hex) {
+    unsigned char buffer[FILEBUFLEN];
+    unsigned char digest[HASH_LEN];
+    struct Sha256 ctx;
+    long total = 0;
+    ssize_t n;
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    sha256Init(&ctx);
+    while ((n = read(fd, buffer, FILEBUFLEN)) > 0) {
+        sha256Update(&ctx, buffer, n);
+        total += n;
+    }
+    close(fd);
+    
+    sha256Final(&ctx, digest);
+    hashToHex(digest, hex);
+    return total;
+}
+
+// Runs the get command. The file is kept in a local cache and the next get
+// sends the server its validator, so an unchanged file is paged from the
+// cache instead of being sent again. A download is written to CACHE_PART_EXT
+// as it arrives, so if the connection drops the next get only asks for the rest.
+void get(int ConnectSocket, char **commands, int k) {
+    char path[BUFLEN] = {0, };
+    char partPath[BUFLEN] = {0, };
+    char validator[128] = "-";
+    char partValidator[128] = {0, };
+    char partHash[HASH_HEX_LEN + 1] = {0, };
+    char command[BUFLEN] = {0, };
+    long partLen = -1;
+    
+    int cacheable = cachePath(commands[1], commands[2], path, BUFLEN);
+    snprintf(partPath, BUFLEN, "%s%s", path, CACHE_PART_EXT);
+    
+    if (cacheable == 0 || readCacheValidator(path, validator, sizeof(validator)) == 0) {
+        strcpy(validator, "-");
+    }
+    if (cacheable && readCacheValidator(partPath, partValidator, sizeof(partValidator))) {
+        partLen = hashFile(partPath, partHash);
+    }
+    
+    if (partLen > 0) {
+        snprintf(command, BUFLEN, "get %s %s %s %s %ld %s\n", commands[1], commands[2], validator, partValidator, partLen, partHash);
+    } else {
+        snprintf(command, BUFLEN, "get %s %s %s\n", commands[1], commands[2], validator);
+    }
+    sendToServer(ConnectSocket, command, BUFLEN);
+    
+    char largeBuf[FILEBUFLEN];
+    int type, fd, len;
+    int numLines = 0;
+    int cacheFd = -1;
+    int complete = 0;
+    // Whether data is still to come of a download that might have been resumed
+    int maybeResumed = 0;
+    
+    while ((len = receiveFrame(ConnectSocket, &type, largeBuf, FILEBUFLEN, &fd)) >= 0) {
+        if (type == FRAME_END) {
+            complete = 1;
+            break;
+        }
+        
+        if (type == FRAME_VALIDATOR && cacheable == 0) {
+            continue;
+        } else if (type == FRAME_VALIDATOR) {
+            // A new version is on its way, cache it as it's paged
+            snprintf(validator, sizeof(validator), "%.*s", len, largeBuf);
+            makeParentDirs(path);
+            maybeResumed = partLen > 0 && strcmp(validator, partValidator) == 0;
+            cacheFd = open(partPath, O_WRONLY | O_CREAT | (maybeResumed ? 0 : O_TRUNC), 0644);
+            writeCacheValidator(partPath, validator);
+            
+        } else if (type == FRAME_RESUME) {
+            // The server is sending the rest of our partial copy, page what we have first
+            largeBuf[len < FILEBUFLEN ? len : FILEBUFLEN - 1] = '\0';
+            long offset = atol(largeBuf);
+            if (cacheFd >= 0) {
+                ftruncate(cacheFd, offset);
+                lseek(cacheFd, offset, SEEK_SET);
+            }
+            
+            int part = open(partPath, O_RDONLY);
+            for (long left = offset; part >= 0 && left > 0; ) {
+                ssize_t n = read(part, largeBuf, left < FILEBUFLEN ? left : FILEBUFLEN);
+                if (n <= 0) {
+                    break;
+                }
+                pageOutput(largeBuf, (int) n, &numLines);
+                left -= n;
+            }
+            if (part >= 0) {
+                close(part);
+            }
+            
+            printf("\n[resumed after %ld bytes]\n", offset);
+            maybeResumed = 0;
+            
+        } else if (type == FRAME_NOT_MODIFIED) {
+            int cached = open(path, O_RDONLY);
+            if (cached < 0) {
+                printf("Cached copy of %s is gone, get it again\n", commands[2]);
+                writeCacheValidator(path, "");
+            } else {
+                printf("[from cache]\n");
+                pageFd(cached, -1, &numLines);
+                close(cached);
+            }
+            
+        } else {
+            if (maybeResumed && cacheFd >= 0) {
+                // Sent from the start after all
+                ftruncate(cacheFd, 0);
+                maybeResumed = 0;
+            }
+            
+            if (fd >= 0) {
+                // Local connection, read the file straight from the descriptor
+                pageFd(fd, cacheFd, &numLines);
+                close(fd);
+            } else {
+                if (type == FRAME_DATA && cacheFd >= 0) {
+                    write(cacheFd, largeBuf, len);
+                }
+                pageOutput(largeBuf, len, &numLines);
+            }
+        }
+    }
+    
+    // Only a whole file replaces the cached one, the partial copy stays for next time
+    if (cacheFd >= 0) {
+        close(cacheFd);
+        if (complete && rename(partPath, path) == 0) {
+            char partValidatorPath[BUFLEN];
+            snprintf(partValidatorPath, BUFLEN, "%s%s", partPath, CACHE_VALIDATOR_EXT);
+            unlink(partValidatorPath);
+            writeCacheValidator(path, validator);
+        }
+    }
+}
+
+// run's trailing -f localfile and -i input, the same ones the server takes off.
+// Sets the index of each one's value, 0 for those not given, and returns input's.
+int runOptions(char **commands, int k, int *localFile, int *input) {
+    *localFile = 0;
+    *input = 0;
+    while (k >= 4 && (strcmp(commands[k - 2], "-f") == 0 || strcmp(commands[k - 2], "-i") == 0)) {
+        if (strcmp(commands[k - 2], "-f") == 0) {
+            *localFile = k - 1;
+        } else {
+            *input = k - 1;
+        }
+        k -= 2;
+    }
+    return *input;
+}
+
+// Streams input to the program run started as DATA frames and then an END frame.
+// Stops early once receiver has taken the whole reply, as the program is done with it.
+void sendInput(int ConnectSocket, FILE *input, pid_t receiver) {
+    char *buffer = malloc(SYNC_CHUNK_LEN);
+    long n;
+    
+    // A terminal gives a line at a time and leaves nothing in stdio's buffer,
+    // anything else goes through stdio so that nothing it read ahead is lost
+    int raw = input != stdin || isatty(STDIN_FILENO);
+    
+    while (waitpid(receiver, NULL, WNOHANG) == 0) {
+        if (raw) {
+            // Waiting a while at a time to see if the program has finished
+            struct pollfd readable = {fileno(input), POLLIN, 0};
+            if (poll(&readable, 1, 250) <= 0) {
+                continue;
+            }
+            n = read(fileno(input), buffer, SYNC_CHUNK_LEN);
+        } else {
+            n = (long) fread(buffer, 1, SYNC_CHUNK_LEN, input);
+        }
+        if (n <= 0) {
+            break;
+        }
+        sendFrame(ConnectSocket, FRAME_DATA, buffer, (uint32_t) n);
+    }
+    
+    sendFrame(ConnectSocket, FRAME_END, NULL, 0);
+    free(buffer);
+}
+
+// Sends a run and writes out its reply as it arrives, program output to the
+// local file if there is one and the rest to the screen. With -i the input is
+// sent from here while a child takes the reply.
+void runCommand(int ConnectSocket, char *inputCopy, char **commands, int k) {
+    int shouldLocal, input;
+    runOptions(commands, k, &shouldLocal, &input);
+    
+    char fileName[BUFLEN] = "";
+    if (shouldLocal != 0) {
+        strcat(fileName, commands[shouldLocal]);
+        strcat(fileName, ".txt");
+    }
+    
+    if (access(fileName, F_OK) == 0) {
+        printf("File exists!\n");
+        return;
+    }
+    
+    FILE *inputFile = NULL;
+    if (input != 0) {
+        inputFile = strcmp(commands[input], "-") == 0 ? stdin : fopen(commands[input], "r");
+        if (inputFile == NULL) {
+            perror("Unable to open input");
+            return;
+        }
+    }
+    
+    int outFd = -1;
+    if (shouldLocal != 0) {
+        outFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outFd < 0) {
+            perror("Unable to open local file");
+            exit(1);
+        }
+    }
+    
+    sendToServer(ConnectSocket, inputCopy, BUFLEN);
+    printf("\n--- Response --- \n");
+    fflush(stdout);
+    
+    pid_t receiver = 0;
+    if (inputFile != NULL) {
+        receiver = fork();
+        if (receiver < 0) {
+            perror("Input fork failed with error, running without input");
+            sendFrame(ConnectSocket, FRAME_END, NULL, 0);
+        } else if (receiver > 0) {
+            if (outFd >= 0) {
+                close(outFd);
+            }
+            sendInput(ConnectSocket, inputFile, receiver);
+            if (inputFile == stdin) {
+                // The terminal can be read again after ^D
+                clearerr(stdin);
+            } else {
+                fclose(inputFile);
+            }
+            
+            // Unless sig_child got to it first
+            while (waitpid(receiver, NULL, 0) < 0 && errno == EINTR);
+            return;
+        }
+    }
+    
+    // Program output is written to the local file if there is one frame by frame
+    // as it arrives, so only a frame is held at a time. The rest goes to the screen.
+    struct FileSink sink;
+    char recvbuf[FILEBUFLEN];
+    int type, fd, len;
+    
+    sinkOpen(&sink, outFd >= 0 ? outFd : STDOUT_FILENO);
+    while ((len = receiveFrame(ConnectSocket, &type, recvbuf, FILEBUFLEN, &fd)) >= 0 && type != FRAME_END) {
+        if (fd >= 0) {
+            // The server passed the program's output pipe, write it out from here
+            sinkCopyFd(&sink, fd);
+            close(fd);
+        } else if (type == FRAME_DATA && outFd >= 0) {
+            sinkWrite(&sink, recvbuf, len);
+        } else {
+            fwrite(recvbuf, 1, len, stdout);
+            fflush(stdout);
+        }
+    }
+    
+    if (outFd >= 0) {
+        sinkClose(&sink, fileName, len >= 0);
+    }
+    if (inputFile != NULL && receiver == 0) {
+        exit(0);
+    }
+}
+
 // Main loop
 void commandLine(int ConnectSocket) {
     
     char input[BUFLEN];
     char inputCopy[BUFLEN];
     
-    char recvbuf[2048];
-    int iResult = 0;
-    int recvbuflen = 2048;
     int k;
     printf("Enter a command: ");
     
@@ -195,7 +1646,7 @@ skipProcessing:
         commands = separateCommands(input, &k);
         
         pid_t pid;
-        memset(recvbuf, 0, 2048);
+        int localFile, runInput;
         
         // Begin processing the command
         if ((strcmp(commands[0], "quit") == 0) || (strcmp(commands[0], "-q") == 0)) {
@@ -209,42 +1660,23 @@ skipProcessing:
             put(ConnectSocket, inputCopy, BUFLEN, commands, k);
             printf("\nEnter a command: ");
             
-        } else if ((strcmp(commands[0], "get") == 0)) {
+        } else if (strcmp(commands[0], "sync") == 0) {
+            syncFiles(ConnectSocket, inputCopy, BUFLEN, commands, k);
+            printf("\nEnter a command: ");
+            
+        } else if (strcmp(commands[0], "run") == 0 && runOptions(commands, k, &localFile, &runInput) != 0) {
+            // Input from the terminal has to be read here, not in a child racing the prompt
+            runCommand(ConnectSocket, inputCopy, commands, k);
+            printf("\nEnter a command: ");
             
-            int done = 0;
+        } else if ((strcmp(commands[0], "get") == 0)) {
             
             if (k == 3) {
-                sendToServer(ConnectSocket, inputCopy, BUFLEN);
-                char largeBuf[FILEBUFLEN];
-                receive(ConnectSocket, iResult, largeBuf, FILEBUFLEN);
-                
-                int numLines = 0;
-                for (int i = 0; i < FILEBUFLEN; i++) {
-                    if ((int)largeBuf[i] == 10) {
-                        numLines += 1;
-                        
-                        if (numLines % 40 != 0) {
-                            printf("%c", largeBuf[i]);
-                        } else {
-                            printf("\n---");
-                            getchar();
-                        }
-                        
-                    } else if ((int)largeBuf[i] == 0) {
-                        // we can stop now
-                        done = 1;
-                        break;
-                    } else {
-                        printf("%c", largeBuf[i]);
-                    }
-                }
-                
+                get(ConnectSocket, commands, k);
+                printf("\nEnter a command: ");
             } else {
                 printf("get takes 3 arguments");
             }
-            if (done == 1) {
-                printf("\nEnter a command: ");
-            }
             
         } else {
             // Non-synchronous operation
@@ -259,50 +1691,30 @@ skipProcessing:
                 
                 if (strcmp(commands[0], "sys") == 0 && k != 0) {
                     sendToServer(ConnectSocket, inputCopy, BUFLEN);
-                    printf("\n--- Response --- \n%s\n", receive(ConnectSocket, iResult, recvbuf, recvbuflen));
+                    printResponse(ConnectSocket);
+                }
+                else if ((strcmp(commands[0], "profile") == 0)) {
+                    sendToServer(ConnectSocket, inputCopy, BUFLEN);
+                    printResponse(ConnectSocket);
                 }
                 else if ((strcmp(commands[0], "list") == 0)) {
                     sendToServer(ConnectSocket, inputCopy, BUFLEN);
-                    printf("\n--- Response --- \n%s\n", receive(ConnectSocket, iResult, recvbuf, recvbuflen));
+                    printResponse(ConnectSocket);
+                }
+                else if ((strcmp(commands[0], "stats") == 0) || (strcmp(commands[0], "trace") == 0) ||
+                         (strcmp(commands[0], "memo") == 0)) {
+                    sendToServer(ConnectSocket, inputCopy, BUFLEN);
+                    printResponse(ConnectSocket);
                 }
                 else if (strcmp(commands[0], "run") == 0) {
-                    
-                    int shouldLocal = 0;
-                    for (int i = 0; i < k; i++) {
-                        if (strcmp(commands[i], "-f") == 0) {
-                            shouldLocal = i+1;
-                            break;
-                        }
-                    }
-                    
-                    char fileName[BUFLEN] = "";
-                    if (shouldLocal != 0) {
-                        strcat(fileName, commands[shouldLocal]);
-                        strcat(fileName, ".txt");
-                    }
-                    
-                    if (access(fileName, F_OK) == 0) {
-                        printf("File exists!\n");
-                    } else {
-                        sendToServer(ConnectSocket, inputCopy, BUFLEN);
-                        
-                        printf("\n--- Response --- \n%s\n", receive(ConnectSocket, iResult, recvbuf, recvbuflen));
-                        
-                        if (shouldLocal != 0) {
-                            FILE *fp;
-                            
-                            fp = fopen(fileName, "w+");
-                            fwrite(recvbuf, 1, recvbuflen, fp);
-                            fclose(fp);
-                        }
-                    }
-                    
+                    runCommand(ConnectSocket, inputCopy, commands, k);
                 }
                 else {
-                    printf("Command is malformed or not accepted.\nPlease use the following:\n* put progname sourcefile[s] [-f]\n* get progname sourcefile\n* list [-l] progname\n* sys\n");
+                    printf("Command is malformed or not accepted.\nPlease use the following:\n* put progname sourcefile[s] [-f]\n* run progname [args] [-i inputfile|-] [-f localfile]\n* sync progname sourcefile[s]\n* get progname sourcefile\n* list [-l] progname\n* sys\n* stats\n* trace [rate|off]\n* memo progname [on [ttl-seconds [max-bytes]]|off]\n* profile progname [default|debug|O2|native|lto|pgo]\n");
                 }
                     
                 printf("\nEnter a command: ");
+                exit(0);
                     
             } else if (pid < 0) {
                 perror("Child process creation with fork failed with error");
@@ -318,18 +1730,38 @@ skipProcessing:
 
 
 // Connects socket and handles errors
-int connectServer(const char *serverAddress) {
+int connectServer(const char *serverAddress, const char *port) {
 
     int iResult;
-    struct sockaddr_in Address = {0};
+    struct addrinfo hints = {0}, *Address;
     int ConnectSocket = 0;
 
-    // Set Address struct elements
-    Address.sin_family = AF_INET; // IPv4
-    Address.sin_addr.s_addr = inet_addr(serverAddress); // Address to connect to server
-    Address.sin_port = htons( PORT );
+    // A path is the server's unix domain socket
+    if (strchr(serverAddress, '/') != NULL) {
+        struct sockaddr_un LocalAddress = {0};
+        LocalAddress.sun_family = AF_UNIX;
+        snprintf(LocalAddress.sun_path, sizeof(LocalAddress.sun_path), "%s", serverAddress);
+        
+        ConnectSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (ConnectSocket < 0 || connect(ConnectSocket, (struct sockaddr *) &LocalAddress, sizeof(LocalAddress)) < 0) {
+            perror("Unable to connect to server\n");
+            _exit(1);
+        }
+        
+        LocalConnection = 1;
+        return ConnectSocket;
+    }
+
+    // Resolve the ipv4 or ipv6 address of the server
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    iResult = getaddrinfo(serverAddress, port, &hints, &Address);
+    if (iResult != 0) {
+        printf("Unable to resolve %s: %s\n", serverAddress, gai_strerror(iResult));
+        _exit(1);
+    }
     
-    ConnectSocket = socket(AF_INET, SOCK_STREAM, 0);
+    ConnectSocket = socket(Address->ai_family, SOCK_STREAM, 0);
 
     if (ConnectSocket < 0) {
         perror("Socket failed with error: \n");
@@ -337,7 +1769,8 @@ int connectServer(const char *serverAddress) {
     }
     
     // Connect to server
-    iResult = connect(ConnectSocket, (struct sockaddr *)&Address, sizeof(Address));
+    iResult = connect(ConnectSocket, Address->ai_addr, Address->ai_addrlen);
+    freeaddrinfo(Address);
     if (iResult < 0) {
         close(ConnectSocket);
         ConnectSocket = -1;
@@ -348,22 +1781,104 @@ int connectServer(const char *serverAddress) {
         _exit(1);
     }
 
-    printf("Connected to Server...\n");
     return ConnectSocket;
     
 }
 
+// Offers the server our codecs, or just wanted if one was asked for, and uses
+// the one it picks. Servers without hello reply with an error and we go without.
+void negotiateCodec(int ConnectSocket, const char *wanted) {
+    char hello[BUFLEN] = "hello";
+    char reply[BUFLEN] = {0, };
+    
+    for (int codec = CODEC_LZ; codec < NO_CODECS; codec++) {
+#ifndef HAVE_ZLIB
+        if (codec == CODEC_ZLIB) {
+            continue;
+        }
+#endif
+        if (wanted == NULL || strcmp(wanted, codecNames[codec]) == 0) {
+            strcat(hello, " ");
+            strcat(hello, codecNames[codec]);
+        }
+    }
+    strcat(hello, "\n");
+    
+    sendToServer(ConnectSocket, hello, BUFLEN);
+    receiveText(ConnectSocket, reply, BUFLEN);
+    
+    for (int codec = CODEC_LZ; codec < NO_CODECS; codec++) {
+        if (strncmp(reply, "codec ", 6) == 0 && strcmp(reply + 6, codecNames[codec]) == 0) {
+            Codec = codec;
+        }
+    }
+}
 
-int main(int argc, const char * argv[]) {
+int main(int argc, char * argv[]) {
+    int opt;
+    const char *codec = NULL;
+    const char *name = argv[0];
+    
+    while ((opt = getopt(argc, argv, "z:y:j:")) != -1) {
+        switch (opt) {
+            case 'z':
+                codec = optarg;
+                break;
+            case 'j':
+                PutStreams = atoi(optarg);
+                if (PutStreams < 1 || PutStreams > PUT_MAX_STREAMS) {
+                    argc = 0;
+                }
+                break;
+            case 'y':
+                if (strcmp(optarg, "none") == 0) {
+                    FileSyncEvery = FILE_SYNC_NONE;
+                } else if (strcmp(optarg, "end") == 0) {
+                    FileSyncEvery = FILE_SYNC_END;
+                } else if (atol(optarg) > 0) {
+                    FileSyncEvery = atol(optarg) * 1024 * 1024;
+                } else {
+                    argc = 0;
+                }
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    
     // Check to make sure we have enough args
-    if (argc != 2) {
-        printf("usage: %s server-ip\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+        printf("usage: %s [-z none|lz|zlib] [-y none|end|MB] [-j streams] server-ip [port]\n", name);
+        printf("       %s [-z none|lz|zlib] [-y none|end|MB] [-j streams] /path/to/server.sock\n", name);
+        printf("  -j  connections put uploads large file sets over at once, 1 to %d (default %d)\n", PUT_MAX_STREAMS, PUT_STREAMS);
+        printf("  -y  when run -f syncs its file: never, at the end, or every so many MB and at the end\n");
         return 1;
     }
     
+    char port[16] = {0, };
+    snprintf(port, sizeof(port), "%s", argc == 3 ? argv[2] : DEFAULT_PORT);
+    
+    snprintf(ServerName, BUFLEN, "%s_%s", argv[1], port);
+    for (char *c = ServerName; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '_';
+        }
+    }
+    
     //Connect to the server
     int ConnectSocket;
-    ConnectSocket = connectServer(argv[1]);
+    ConnectSocket = connectServer(argv[1], port);
+    printf("Connected to Server...\n");
+    snprintf(ServerAddress, BUFLEN, "%s", argv[1]);
+    snprintf(ServerPort, sizeof(ServerPort), "%s", port);
+    
+    // Local connections don't gain anything from compression unless asked for
+    if (codec != NULL ? strcmp(codec, "none") != 0 : LocalConnection == 0) {
+        negotiateCodec(ConnectSocket, codec);
+        printf("Compression: %s\n", codecNames[Codec]);
+    }
     
     // Main loop
     commandLine(ConnectSocket);
@@ -6,6 +6,18 @@
 //  Copyright © 2020 Dante Mattson. All rights reserved.
 //
 
+// Linux only, for sched_setaffinity
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+// Linux only, for reflinking blobs into prognames
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -29,25 +41,417 @@
 #include <signal.h>
 #include <stdint.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <stdarg.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #define PORT 8080
+#define ADDRESS "127.0.0.1"
+#define ADDRESS6 "::"
+
+// Every reply is a run of frames, each a FRAME_HEADER_LEN header then the payload.
+// DATA is the command's output, INFO messages from the server, FD carries a
+// file descriptor for a local client and END finishes the reply.
+#define FRAME_HEADER_LEN 8
+#define FRAME_DATA 'D'
+#define FRAME_INFO 'I'
+#define FRAME_FD 'F'
+#define FRAME_END 'E'
+
+// A frame the sender compressed: COMPRESS_HEADER_LEN bytes of the original
+// type and length, then the original payload packed with the negotiated codec
+#define FRAME_COMPRESSED 'Z'
+#define COMPRESS_HEADER_LEN 5
+
+// Codecs a client can ask for with hello
+#define CODEC_NONE 0
+#define CODEC_LZ 1
+#define CODEC_ZLIB 2
+#define NO_CODECS 3
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+// Chunks under COMPRESS_MIN_LEN go as they are, as do ones that don't shrink by
+// an eighth. After COMPRESS_MAX_MISSES of those in a row only every
+// COMPRESS_RETRY_EVERY'th chunk is tried until one compresses again.
+#define COMPRESS_MIN_LEN 256
+#define COMPRESS_MAX_MISSES 4
+#define COMPRESS_RETRY_EVERY 8
+
+// get sends the file's validator in a VALIDATOR frame before its content.
+// A client that sends back the same validator gets NOT_MODIFIED instead of the content.
+#define FRAME_VALIDATOR 'V'
+#define FRAME_NOT_MODIFIED 'N'
+
+// Sent after VALIDATOR when a get carries on from where an earlier one was cut
+// off, the payload being the offset in decimal that the content starts from
+#define FRAME_RESUME 'R'
+
+// Replies are built in pooled segments and by default go out once RESP_FLUSH_LEN is buffered
+#define SEGMENT_LEN 16384
+#define RESP_FLUSH_LEN 65536
+#define RESP_POOL_MAX 16
+#define RESP_IOV_BATCH 64
+
+// Budgets for reply data buffered and not yet sent. A reply flushes once it has
+// the per connection budget buffered, or before it takes a new segment that
+// would put every connection together over the global one.
+#define CONN_BUDGET RESP_FLUSH_LEN
+#define GLOBAL_BUDGET (64L * 1024 * 1024)
+
+// A client not taking data for STALL_GRACE_MS counts as stalled, and is
+// evicted by the policy once it has been stalled STALL_TIMEOUT seconds
+#define STALL_GRACE_MS 100
+#define STALL_POLL_MS 1000
+#define STALL_TIMEOUT 120
+#define EVICT_NEVER 0
+#define EVICT_STALLED 1
+#define EVICT_PRESSURE 2
+
+// Spans traced with -t go to the trace file as Chrome trace events, one JSON
+// object a line in an array left open so that every process can append to it.
+// A full file is moved to TRACE_OLD_EXT and a new one started.
+#define TRACE_MAX_BYTES (16L * 1024 * 1024)
+#define TRACE_OLD_EXT ".1"
+#define TRACE_RATE_SCALE 1000000
+
+// Requests are counted by command, outcome and latency. Latencies go in
+// LATENCY_BUCKETS buckets bounded by latencyBounds, the last being everything over.
+#define NO_COMMANDS 14
+#define OUTCOME_OK 0
+#define OUTCOME_ERROR 1
+#define NO_OUTCOMES 2
+#define LATENCY_BUCKETS 12
+
+// Command processes a connection can have running and waiting to be recorded
+#define PENDING_MAX 256
+
+// Metrics pages are built whole before they are sent
+#define METRICS_MAX_LEN 65536
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 #define BUFLEN 512
-#define FILEBUFLEN 40960
 
-// Start up the server socket and wait for connections
-int serverStartup(struct sockaddr_in Address) {
+// Build state kept in each progname directory
+#define BUILD_PROFILE_FILE ".buildprofile"
+#define BUILD_STAMP_FILE ".buildstamp"
+#define PROFILE_STATS_FILE ".profilestats"
+#define PGO_STATE_FILE ".pgostate"
+#define PGO_DATA_DIR ".pgo"
+#define PGO_TRAINING_RUNS 3
+#define BUILD_LOCK_FILE ".buildlock"
+#define BUILT_BY_FILE ".builtby"
+#define BACKGROUND_BUILD_FILE ".bgbuild"
+
+// Prognames with a BUILD_MANIFEST_FILE, CMakeLists.txt or Makefile are built as a
+// project in BUILD_DIR/<profile>, kept between builds so that rebuilds are incremental.
+// Projects produce an executable named main, which run links into place.
+// Sources are looked for down to BUILD_MAX_DEPTH directories.
+#define BUILD_DIR ".build"
+#define BUILD_MANIFEST_FILE "build.manifest"
+#define BUILD_MAX_DEPTH 8
+#define MANIFEST_MAKEFILE_MAX 16384
+#define PROJECT_GCC 0
+#define PROJECT_MAKE 1
+#define PROJECT_CMAKE 2
+#define PROJECT_MANIFEST 3
+
+// Memoized runs, on per progname with the memo command. MEMO_FILE holds
+// "ttl:maxBytes" and results go in MEMO_DIR, named by a hash of the binary, the
+// progname's other files and the arguments. A result is the run's wait status
+// in MEMO_HEADER_LEN bytes followed by its output, which is kept up to MEMO_MAX_ENTRY.
+#define MEMO_FILE ".memo"
+#define MEMO_DIR ".memocache"
+#define MEMO_HEADER_LEN 32
+#define MEMO_TTL (24 * 60 * 60)
+#define MEMO_MAX_BYTES (64L * 1024 * 1024)
+#define MEMO_MAX_ENTRY (4L * 1024 * 1024)
+
+// Builds started after a put run at this niceness
+#define BACKGROUND_BUILD_NICE 19
+
+// sync sends a file's hash and, past SYNC_BLOCK_MIN bytes, a signature per block:
+// a 4 byte rolling checksum and the first SYNC_STRONG_LEN bytes of the block's SHA-256.
+// Blocks double in size until there are at most SYNC_MAX_BLOCKS.
+#define HASH_LEN 32
+#define HASH_HEX_LEN (2 * HASH_LEN)
+#define SYNC_BLOCK_MIN 2048
+#define SYNC_MAX_BLOCKS 1024
+#define SYNC_STRONG_LEN 16
+#define SYNC_SIG_LEN (4 + SYNC_STRONG_LEN)
+#define SYNC_CHUNK_LEN 65536
+
+// What the client has to send of a file
+#define SYNC_SAME 0
+#define SYNC_ALL 1
+#define SYNC_BLOCKS 2
+#define SYNC_HAVE 3
+#define SYNC_RESUME 4
+
+// Uploaded files are stored once under BLOB_DIR in the server's directory,
+// named by their SHA-256, and copied into progname directories
+#define BLOB_DIR ".blobs"
+#define BLOB_TMP_DIR "tmp"
+#define BLOB_LOCK_FILE ".lock"
+
+// Blobs are only ever read, programs and builds get copies of their own
+#define BLOB_MODE 0444
+
+// Each progname lists the files put or synced into it as "hash name" lines,
+// the hashes being the blobs that collection keeps
+#define UPLOADS_FILE ".uploads"
+
+// A dropped upload stays in BLOB_TMP_DIR as hash.part, for a day after it was last written
+#define BLOB_PART_EXT ".part"
+#define BLOB_PART_MAX_AGE (24 * 60 * 60)
+
+// Blobs stored with the blob command wait for the put that copies them, so
+// collection leaves unlisted blobs alone for BLOB_LINK_GRACE after they're stored
+#define BLOB_LINK_GRACE (60 * 60)
+
+// Warm children the zygote keeps forked and ready to exec
+#define ZYGOTE_POOL_SIZE 4
+// A program's stdout and stdin, sent to the zygote along with a reply socket
+#define SPAWN_MAX_FDS 2
+#define PASS_MAX_FDS (SPAWN_MAX_FDS + 1)
+
+// A program launch handed to the zygote, along with the program's fds
+struct SpawnRequest {
+    char dir[BUFLEN];
+    // NUL separated arguments, argv[0] first
+    char argv[BUFLEN];
+    int argvLen;
+};
+
+// Sent back by the zygote once when the program starts and once when it exits
+struct SpawnReply {
+    pid_t pid;
+    int status;
+    int exited;
+};
+
+struct WarmChild {
+    pid_t pid;
+    int sock;
+};
+
+// One frame's worth of a reply
+struct Segment {
+    int type;
+    size_t len;
+    struct Segment *next;
+    char data[SEGMENT_LEN];
+};
+
+// A reply being built, a chain of segments not yet sent
+struct Response {
+    int sock;
+    struct Segment *head;
+    struct Segment *tail;
+    size_t buffered;
+};
+
+// Segments of sent replies, reused before mallocing new ones
+struct Segment *SegmentPool = NULL;
+int SegmentPoolSize = 0;
+
+// Codec the client picked with hello, none until it does
+int Codec = CODEC_NONE;
+
+// Compression during the current command, for respCompressionStats
+struct CompressStats {
+    long rawOut;
+    long packedOut;
+    long rawIn;
+    long packedIn;
+    int chunks;
+    int rawChunks;
+    int misses;
+    long cpuNs;
+};
+
+struct CompressStats Compression;
+
+// Counters shared by every process of the server, mapped before anything forks
+struct ServerStats {
+    long connections;
+    long totalConnections;
+    // Reply bytes buffered and not yet sent, across every connection
+    long buffered;
+    long peakBuffered;
+    // Replies flushed early because of the global budget
+    long budgetFlushes;
+    long stalled;
+    long stalls;
+    long stallMs;
+    long evictions;
+    // Requests so far, the last one's number is its id
+    long requests;
+    // Requests traced per TRACE_RATE_SCALE, set with the trace command
+    long traceRate;
+    long requestsBy[NO_COMMANDS][NO_OUTCOMES];
+    long latency[NO_COMMANDS][LATENCY_BUCKETS];
+    long latencyUs[NO_COMMANDS];
+    // Requests received and not finished
+    long inFlight;
+    // Command processes and programs running
+    long activeChildren;
+    long activePrograms;
+    // Runs that found main built already, runs that compiled it, and runs waiting on the build lock
+    long buildHits;
+    long buildMisses;
+    long buildWaiting;
+    // Builds compiling right now, which share the build jobs between them
+    long activeBuilds;
+    long bytesSent;
+    long bytesReceived;
+    // Runs answered from and missing the memo cache
+    long memoHits;
+    long memoMisses;
+};
+
+struct ServerStats *Stats = NULL;
+
+// This process's share of Stats->buffered, given back if it exits mid reply
+long ProcessBuffered = 0;
+
+// The connection process, the one that counts in Stats->connections
+pid_t ConnectionPid = 0;
+
+const char *evictNames[] = {"never", "stalled", "pressure"};
+const char *projectNames[] = {"gcc", "make", "cmake", "manifest"};
+
+const char *commandNames[NO_COMMANDS] = {"put", "blob", "sync", "hello", "get", "list", "run", "sys", "profile", "stats", "trace", "memo", "quit", "other"};
+const char *outcomeNames[NO_OUTCOMES] = {"ok", "error"};
+const long latencyBounds[LATENCY_BUCKETS - 1] = {1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 5000000, 30000000};
+
+// A request being run by a child of the connection process
+struct PendingCommand {
+    pid_t pid;
+    int command;
+    struct timespec start;
+};
+
+struct PendingCommand Pending[PENDING_MAX];
+
+// The request the connection process is running itself, pid 0 between them.
+// put, blob and sync exit when the client drops, so statsRelease records it.
+struct PendingCommand InProcess;
+
+// Trace file, -1 without -t
+int TraceFd = -1;
+
+// Whether what this process is doing now is sampled, and the request and connection it's for
+int Tracing = 0;
+long TraceRequest = 0;
+long TraceConnection = 0;
+
+// The command this process is running, traced as a span when it ends
+char TraceCommand[32] = "";
+struct timespec TraceCommandStart;
+
+// Connection to the zygote, -1 if it isn't running
+int ZygoteSocket = -1;
+
+// The process feeding a run's program the stdin streamed by the client, 0 if there
+// isn't one, and the pipe it writes to
+pid_t StdinForwarder = 0;
+int StdinPipe = -1;
+
+// Settings from the command line
+struct ServerConfig {
+    char address[64];
+    int port;
+    int ipv6;
+    // Acceptor processes, each with its own SO_REUSEPORT listener
+    int workers;
+    int pinCpus;
+    // Unix domain socket for local clients, empty for none
+    char unixPath[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    // Reply data budgets in bytes and what to do about clients that stop reading
+    long connBudget;
+    long globalBudget;
+    int stallTimeout;
+    int evictPolicy;
+    // Trace file, empty for no tracing
+    char tracePath[BUFLEN];
+    // Local port for metrics, 0 for none
+    int metricsPort;
+    // Compile jobs shared by all the builds going at once, 0 for one per core
+    int buildJobs;
+};
+
+struct ServerConfig Config = {ADDRESS, PORT, 0, 1, 0, "", CONN_BUDGET, GLOBAL_BUDGET, STALL_TIMEOUT, EVICT_STALLED, "", 0, 0};
+
+// Shared by every worker, -1 without -u
+int UnixListenSocket = -1;
+
+// Ends a forked command's request, defined with the stats further down
+void commandFinished(pid_t pid, int stat);
+
+// Unix socket helpers, defined with the zygote further down
+int sendWithFds(int sock, void *buffer, size_t len, int *fds, int nfds);
+void setCloseOnExec(int fd);
+
+// Build helpers, defined with the profiles further down
+int lockBuild(const char *dir);
+void unlockFile(int lockFd);
+void cancelBackgroundBuild(const char *dir);
+void startBackgroundBuild(const char *dir);
+
+// Start up a server socket and wait for connections
+int serverStartup(void) {
     int ListenSocket;
     int iResult;
+    int on = 1, off = 0;
+    char port[16] = {0, };
+    struct addrinfo hints = {0}, *Address;
+
+    // Resolve the configured address, ipv6 when dual stack was asked for
+    snprintf(port, sizeof(port), "%d", Config.port);
+    hints.ai_family = Config.ipv6 ? AF_INET6 : AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+    iResult = getaddrinfo(Config.address, port, &hints, &Address);
+    if (iResult != 0) {
+        printf("Unable to use address %s: %s\n", Config.address, gai_strerror(iResult));
+        exit(1);
+    }
 
-    // Initialise ListenSocket with ipv4 and stream protocol
-    ListenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    // Initialise ListenSocket with the address family and stream protocol
+    ListenSocket = socket(Address->ai_family, SOCK_STREAM, 0);
     if (ListenSocket < 0) {
         perror("Socket failed with error");
         exit(1);
     }
+    setCloseOnExec(ListenSocket);
+    
+    // Accept ipv4 clients on the ipv6 socket as well
+    if (Config.ipv6) {
+        setsockopt(ListenSocket, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
     
-    // Bind to the specified address from the Address sockaddr_in struct
-    iResult = bind(ListenSocket, (struct sockaddr *)&Address, sizeof(Address));
+    // Each worker binds its own socket and the kernel spreads connections between them
+    if (Config.workers > 1) {
+        if (setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            perror("SO_REUSEPORT failed with error");
+            exit(1);
+        }
+    }
+    
+    // Bind to the resolved address
+    iResult = bind(ListenSocket, Address->ai_addr, Address->ai_addrlen);
+    freeaddrinfo(Address);
     
     if (iResult < 0) {
         perror("Bind failed with error");
@@ -65,12 +469,65 @@ int serverStartup(struct sockaddr_in Address) {
         exit(1);
     }
 
-    printf("Listening on port %d\n", PORT);
+    printf("Listening on %s port %d\n", Config.address, Config.port);
     printf("Waiting on connections...\n");
 
     return ListenSocket;
 }
 
+// Start up the unix domain socket local clients connect to
+int unixStartup(void) {
+    struct sockaddr_un Address = {0};
+    int ListenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    if (ListenSocket < 0) {
+        perror("Unix socket failed with error");
+        exit(1);
+    }
+    setCloseOnExec(ListenSocket);
+    
+    // Workers share the one socket, so whoever loses the race to accept mustn't block
+    fcntl(ListenSocket, F_SETFL, O_NONBLOCK);
+    
+    Address.sun_family = AF_UNIX;
+    snprintf(Address.sun_path, sizeof(Address.sun_path), "%s", Config.unixPath);
+    
+    // Remove the socket left behind by a previous server
+    unlink(Config.unixPath);
+    
+    if (bind(ListenSocket, (struct sockaddr *) &Address, sizeof(Address)) < 0) {
+        perror("Unix bind failed with error");
+        close(ListenSocket);
+        exit(1);
+    }
+    // Clients are handed descriptors to our files, so only our own user may connect.
+    // Nobody can connect before listen, so there's no window with the umask's mode.
+    if (chmod(Config.unixPath, 0600) < 0) {
+        perror("Unix chmod failed with error");
+        close(ListenSocket);
+        exit(1);
+    }
+    if (listen(ListenSocket, SOMAXCONN) < 0) {
+        perror("Unix listen failed with error");
+        close(ListenSocket);
+        exit(1);
+    }
+    
+    printf("Listening on %s\n", Config.unixPath);
+    return ListenSocket;
+}
+
+// 1 if the client connected over the unix domain socket
+int isLocalClient(int ClientSocket) {
+    struct sockaddr_storage Address;
+    socklen_t len = sizeof(Address);
+    
+    if (getsockname(ClientSocket, (struct sockaddr *) &Address, &len) < 0) {
+        return 0;
+    }
+    return Address.ss_family == AF_UNIX;
+}
+
 // Signal child to terminate zombies
 void sig_child(int signum) {
     pid_t pid;
@@ -79,6 +536,7 @@ void sig_child(int signum) {
     // WNOHANG tells the kernel not to block if there are no terminated children.
     while ((pid = waitpid(-1, &stat, WNOHANG)) > 0) {
         printf("child %d terminated\n", pid);
+        commandFinished(pid, stat);
     }
     return;
 }
@@ -90,502 +548,4300 @@ long calcTDiff(struct timespec start) {
     return ((end.tv_nsec - start.tv_nsec)/1000000) + ((end.tv_sec - start.tv_sec)*1000);
 }
 
-// Sends to client and handles errors
-void send_to_client(int ClientSocket, char *buffer, int buflen) {
-    int iSendResult = (int) send(ClientSocket, buffer, buflen, 0);
-    if (iSendResult < 0) {
-        perror("send failed with error:");
-        close(ClientSocket);
-        exit(1);
-    }
+// Adds n to a shared counter, returns the new value
+long statAdd(long *counter, long n) {
+    return __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
 }
 
-// Receives from socket and handles errors
-// Writes to recvbuf
-char* receive(int ClientSocket, char *recvbuf, int recvbuflen) {
-    int iResult;
-    iResult = (int) recv(ClientSocket, recvbuf, recvbuflen, 0);
-    if (iResult > 0) {
-        return recvbuf;
-    }
-    else if ( iResult == 0 ) {
-        printf("Connection Closed\n");
-        exit(1);
-    }
-    else if (iResult == -1) {
-        perror("Receive Failed with error\n");
-        exit(1);
-    }
-    
-    return "Unable to receive\n";
+long statLoad(long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
 }
 
-// Runs put (to get files from client) and handles errors
-void putCmd(int ClientSocket, char **commands, int noCommands) {
-    struct timespec start = {0};
-    char responseTime[64];
-    clock_gettime(CLOCK_REALTIME, &start);
-    
-    // filesExpectedToRecieve - 1 for "put"
-    int filesExpectedToRecieve = noCommands - 1;
-    
-    int shouldOverride = 0;
-    if (strcmp(commands[noCommands - 1], "-f") == 0) {
-        shouldOverride = 1;
-        // -1 for "-f"
-        filesExpectedToRecieve -= 1;
+// Index of a command in commandNames, the last one for anything unknown
+int commandIndex(const char *name) {
+    for (int i = 0; i < NO_COMMANDS - 1; i++) {
+        if (strcmp(name, commandNames[i]) == 0) {
+            return i;
+        }
     }
+    return NO_COMMANDS - 1;
+}
+
+// Counts a finished request and its latency since start
+void recordRequest(int command, int outcome, struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long us = (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
     
-    // Get the directory name
-    char dirName[40] = {0,};
-    if (noCommands >= 2) {
-        strcpy(dirName, commands[1]);
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && us > latencyBounds[bucket]) {
+        bucket++;
     }
     
-    // -1 for the dirname in the command
-    filesExpectedToRecieve -= 1;
-    
-    // Temporary response & handshake
-    char tempCommBuffer[BUFLEN] = {0, };
-    sprintf(tempCommBuffer, "ok. should get %d files and put them in %s, -f:%d\n", filesExpectedToRecieve, dirName, shouldOverride);
-    send_to_client(ClientSocket, tempCommBuffer, BUFLEN);
-    memset(tempCommBuffer, 0, BUFLEN);
-    
-    // Build path for server
-    char path[BUFLEN] = "";
-    getcwd(path, sizeof(path));
-    strcat(path, "/");
-    strcat(path, dirName);
-    strcat(path, "/");
-    
-    struct stat st = {0};
-    
-    // If directory doesn't exist, create it with 755 perms
-    if (stat(dirName, &st) == -1) {
-        mkdir(dirName, 0755);
+    statAdd(&Stats->requestsBy[command][outcome], 1);
+    statAdd(&Stats->latency[command][bucket], 1);
+    statAdd(&Stats->latencyUs[command], us);
+    statAdd(&Stats->inFlight, -1);
+}
+
+// Remembers the process running a request so it's recorded when it exits.
+// Called with SIGCHLD blocked so the child can't be reaped first.
+void trackCommand(pid_t pid, int command, struct timespec *start) {
+    for (int i = 0; i < PENDING_MAX; i++) {
+        if (Pending[i].pid == 0) {
+            Pending[i].pid = pid;
+            Pending[i].command = command;
+            Pending[i].start = *start;
+            statAdd(&Stats->activeChildren, 1);
+            return;
+        }
     }
-    
-    // Count the number of files that can be recieved
-    int totalOK = 0;
-    
-    char errorString[BUFLEN] = {0, };
-    strcpy(errorString, "File/s ");
-    
-    for (int i = 2; i < 2 + filesExpectedToRecieve - shouldOverride; i++) {
-        char newPath[BUFLEN] = {0, };
-        strcpy(newPath, path);
-        strcat(newPath, commands[i]);
-        
-        // if not file totalOK += 1
-        FILE *tempFilePointer = fopen(newPath, "r");
-        if (tempFilePointer == NULL || shouldOverride == 1) {
-            totalOK += 1;
-        } else {
-            strcat(errorString, commands[i]);
-            strcat(errorString, " ");
-            fclose(tempFilePointer);
+    // No room to wait for it, count it as it starts
+    recordRequest(command, OUTCOME_OK, start);
+}
+
+// Records the request a reaped child was running, if it was running one
+void commandFinished(pid_t pid, int stat) {
+    for (int i = 0; i < PENDING_MAX; i++) {
+        if (Pending[i].pid == pid) {
+            int ok = WIFEXITED(stat) && WEXITSTATUS(stat) == 0;
+            recordRequest(Pending[i].command, ok ? OUTCOME_OK : OUTCOME_ERROR, &Pending[i].start);
+            statAdd(&Stats->activeChildren, -1);
+            Pending[i].pid = 0;
+            return;
         }
-        
-        memset(newPath, 0, BUFLEN);
     }
-    
-    printf("totalOK: %d, filesExpectedToRecieve: %d\n", totalOK, filesExpectedToRecieve);
-    
-    if (totalOK == filesExpectedToRecieve || shouldOverride == 1) {
-        sprintf(tempCommBuffer, "ok");
-    } else {
-        strcat(errorString, "exist in ");
-        strcat(errorString, dirName);
-        strcat(errorString, " on server. Use -f to override.");
-        send_to_client(ClientSocket, errorString, BUFLEN);
-        return;
+}
+
+// Marks the connection process as running command itself from start
+void startInProcess(int command, struct timespec *start) {
+    InProcess.pid = getpid();
+    InProcess.command = command;
+    InProcess.start = *start;
+}
+
+// Records the request the connection process was running as outcome
+void finishInProcess(int outcome) {
+    if (InProcess.pid != 0) {
+        recordRequest(InProcess.command, outcome, &InProcess.start);
+        InProcess.pid = 0;
     }
+}
+
+// Counts n more (or fewer) reply bytes as buffered, keeping track of the peak
+void statsBuffered(long n) {
+    long now = statAdd(&Stats->buffered, n);
+    long peak = statLoad(&Stats->peakBuffered);
     
-    send_to_client(ClientSocket, tempCommBuffer, BUFLEN);
-    char *tempFileBuffer;
-    tempFileBuffer = (char *) malloc(FILEBUFLEN);
-    memset(tempFileBuffer, 0, FILEBUFLEN);
-    int terminatedEarly = 0;
-    
-    // Recieve and write the files
-    for (int i = 2; i < 2 + filesExpectedToRecieve; i++) {
-        char newPath[BUFLEN] = {0, };
-        strcpy(newPath, path);
-        strcat(newPath, commands[i]);
-        printf("writing %s\n", newPath);
+    ProcessBuffered += n;
+    while (now > peak && !__atomic_compare_exchange_n(&Stats->peakBuffered, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Gives back what a process still had buffered, and its connection if it's the connection process
+void statsRelease(void) {
+    if (ProcessBuffered != 0) {
+        statAdd(&Stats->buffered, -ProcessBuffered);
+        ProcessBuffered = 0;
+    }
+    if (getpid() == ConnectionPid) {
+        statAdd(&Stats->connections, -1);
+        ConnectionPid = 0;
         
-        receive(ClientSocket, tempFileBuffer, FILEBUFLEN);
+        // Exiting part way through a request of our own, the client went away
+        finishInProcess(OUTCOME_ERROR);
         
-        FILE *tempFilePointer = fopen(newPath, "w+");
-        if (tempFilePointer != NULL) {
-            
-            int fs = 0;
-            for (int j = 0; j < FILEBUFLEN; j++) {
-                if (tempFileBuffer[j] == 0) {
-                    break;
-                }
-                fs += 1;
+        // Commands still running are left to finish unrecorded
+        for (int i = 0; i < PENDING_MAX; i++) {
+            if (Pending[i].pid != 0) {
+                statAdd(&Stats->inFlight, -1);
+                statAdd(&Stats->activeChildren, -1);
+                Pending[i].pid = 0;
             }
-            
-            fwrite(tempFileBuffer, sizeof(char), fs, tempFilePointer);
-            fclose(tempFilePointer);
-            
-        } else {
-            terminatedEarly = 1;
         }
-        
-        memset(tempFileBuffer, 0, FILEBUFLEN);
-        
     }
-    
-    // Error handling
-    if (terminatedEarly == 0) {
-        char successResponse[BUFLEN] = "File/s sent successfully!\n";
-        snprintf(successResponse, 63, "\n\nTook: %lums", calcTDiff(start));
-        strcat(successResponse, responseTime);
-        send_to_client(ClientSocket, successResponse, BUFLEN);
-        
-    } else {
-        send_to_client(ClientSocket, "unable to write one or more of the files!", BUFLEN);
+}
+
+// Maps the counters every worker and connection process shares
+void statsStartup(void) {
+    Stats = mmap(NULL, sizeof(struct ServerStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Stats == MAP_FAILED) {
+        perror("Unable to map server stats");
+        exit(1);
     }
-    
-    // Free malloc'd memory
-    free(tempFileBuffer);
-    
-    return;
+    memset(Stats, 0, sizeof(struct ServerStats));
+    atexit(statsRelease);
+}
 
+// Opens the trace file to append to, starting the array if this creates it
+int openTraceFile(void) {
+    int fd = open(Config.tracePath, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+        write(fd, "[\n", 2);
+    } else if (errno == EEXIST) {
+        fd = open(Config.tracePath, O_WRONLY | O_APPEND);
+    }
+    if (fd >= 0) {
+        setCloseOnExec(fd);
+    }
+    return fd;
 }
 
-// Runs the sys command using popen and returns the result
-void sysCmd(int ClientSocket) {
-    FILE *sys;
-    struct timespec start;
-    char responseTime[64];
-    clock_gettime(CLOCK_REALTIME, &start);
-    
-    char buf[BUFLEN] = {0, };
-    char line[BUFLEN] = {0, };
-    
-#ifdef __APPLE__
-    
-    sys = popen("sw_vers", "r");
+// Moves a full trace file aside, or picks up the new one if another process already has
+void rotateTrace(void) {
+    struct stat current, named;
+    char oldPath[BUFLEN + 8];
     
-    // Get the operating system information
-    while(fgets(line, BUFLEN, sys) != NULL) {
-        strcat(buf, line);
+    while (flock(TraceFd, LOCK_EX) < 0 && errno == EINTR);
+    if (fstat(TraceFd, &current) == 0 && stat(Config.tracePath, &named) == 0 &&
+        current.st_ino == named.st_ino && current.st_dev == named.st_dev) {
+        snprintf(oldPath, sizeof(oldPath), "%s%s", Config.tracePath, TRACE_OLD_EXT);
+        rename(Config.tracePath, oldPath);
     }
     
-    fclose(sys);
-    
-    // Read popen
-    char buffer[BUFLEN];
-    size_t size = sizeof(buffer);
-    if (sysctlbyname("machdep.cpu.brand_string", &buffer, &size, NULL, 0) < 0) {
-        perror("sysctl");
+    int fd = openTraceFile();
+    flock(TraceFd, LOCK_UN);
+    if (fd >= 0) {
+        close(TraceFd);
+        TraceFd = fd;
     }
-    strcat(buf, "\n");
-    strcat(buf, buffer);
+}
+
+long timestampUs(struct timespec *t) {
+    return t->tv_sec * 1000000L + t->tv_nsec / 1000;
+}
+
+// Copies text into out as the inside of a JSON string
+void jsonEscape(const char *text, char *out, int outLen) {
+    int len = 0;
     
-#endif
+    for (; *text != '\0' && len < outLen - 3; text++) {
+        if (*text == '"' || *text == '\\') {
+            out[len++] = '\\';
+        } else if ((unsigned char) *text < ' ') {
+            continue;
+        }
+        out[len++] = *text;
+    }
+    out[len] = '\0';
+}
+
+// Traces a span from start to end if what this process is doing is sampled.
+// detail is optional, the file compiled for instance.
+void traceSpan(const char *name, struct timespec *start, struct timespec *end, const char *detail) {
+    char event[BUFLEN * 2];
+    char escapedName[64];
+    char escaped[BUFLEN] = "";
+    char request[64] = "";
+    struct stat st;
     
-#ifdef __linux__
-    // Linux code
-    sys = popen("lshw -class processor", "r");
-    while (fgets(line, BUFLEN, sys) != NULL) {
-        strcat(buf, line);
+    if (TraceFd < 0 || Tracing == 0) {
+        return;
+    }
+    // For forked commands the name is whatever the client sent
+    jsonEscape(name, escapedName, sizeof(escapedName));
+    if (detail != NULL) {
+        jsonEscape(detail, escaped, BUFLEN);
+    }
+    if (TraceRequest > 0) {
+        snprintf(request, sizeof(request), "\"request\":%ld,", TraceRequest);
     }
-#endif
     
-    // Send response
-    snprintf(responseTime, 63, "\n\nTook: %lums", calcTDiff(start));
-    strcat(buf, responseTime);
-    send_to_client(ClientSocket, buf, BUFLEN);
+    int len = snprintf(event, sizeof(event),
+                       "{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d,"
+                       "\"args\":{%s\"connection\":%ld%s%s%s}},\n",
+                       escapedName, timestampUs(start), timestampUs(end) - timestampUs(start), getpid(), getpid(),
+                       request, TraceConnection, detail != NULL ? ",\"detail\":\"" : "", escaped, detail != NULL ? "\"" : "");
     
-    return;
+    if (fstat(TraceFd, &st) == 0 && st.st_size >= TRACE_MAX_BYTES) {
+        rotateTrace();
+    }
+    // Appends of a line at a time don't interleave with other processes'
+    write(TraceFd, event, len);
 }
 
-// Returns 1 = file, 0 = dir
-int isFileOrDir(const char *path) {
-    struct stat path_stat;
-    stat(path, &path_stat);
-    return S_ISREG(path_stat.st_mode);
+// Traces a span from start until now
+void traceSince(const char *name, struct timespec *start, const char *detail) {
+    struct timespec now;
+    
+    if (Tracing) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        traceSpan(name, start, &now, detail);
+    }
 }
 
-// Runs get command and handles errors
-void getCmd(int ClientSocket, char **commands, int k) {
+// Whether the request or connection numbered id is traced at the current rate
+int traceSampled(long id) {
+    long rate = statLoad(&Stats->traceRate);
     
+    if (TraceFd < 0 || rate <= 0) {
+        return 0;
+    }
+    // Spread ids that follow one another across the range so any rate samples evenly
+    return rate >= TRACE_RATE_SCALE || (unsigned long) id * 2654435761UL % TRACE_RATE_SCALE < (unsigned long) rate;
+}
+
+// Starts the span of the command this process is about to run
+void traceCommandStart(const char *name) {
+    snprintf(TraceCommand, sizeof(TraceCommand), "%s", name);
+    clock_gettime(CLOCK_REALTIME, &TraceCommandStart);
+}
+
+// Ends the command's span, also called on exit for commands that exit when done
+void traceCommandEnd(void) {
+    if (TraceCommand[0] != '\0') {
+        traceSince(TraceCommand, &TraceCommandStart, NULL);
+        TraceCommand[0] = '\0';
+    }
+}
+
+// Opens the trace file given with -t, tracing every request until the trace command says otherwise
+void traceStartup(void) {
+    TraceFd = openTraceFile();
+    if (TraceFd < 0) {
+        perror("Unable to open trace file");
+        exit(1);
+    }
+    Stats->traceRate = TRACE_RATE_SCALE;
+    atexit(traceCommandEnd);
+    printf("Tracing to %s\n", Config.tracePath);
+}
+
+// Whether the eviction policy gives up on a client stalled for ms
+int shouldEvict(long ms) {
+    if (Config.evictPolicy == EVICT_NEVER || ms < Config.stallTimeout * 1000L) {
+        return 0;
+    }
+    if (Config.evictPolicy == EVICT_PRESSURE) {
+        // Only once the global budget is nine tenths used
+        return statLoad(&Stats->buffered) >= Config.globalBudget - Config.globalBudget / 10;
+    }
+    return 1;
+}
+
+// Waits for a client that isn't taking data to make room for more. Nothing
+// more is read from the producer meanwhile, so a program writing to a pipe
+// blocks until the client catches up. Returns -1 if the client was evicted.
+int waitWritable(int sock) {
+    struct pollfd writable = {sock, POLLOUT, 0};
+    struct timespec start;
+    int stalled = 0;
+    int evicted = 0;
+    
+    clock_gettime(CLOCK_REALTIME, &start);
+    
+    while (1) {
+        int ready = poll(&writable, 1, stalled ? STALL_POLL_MS : STALL_GRACE_MS);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        // Writable, or an error that sendmsg will report
+        if (ready != 0) {
+            break;
+        }
+        
+        if (stalled == 0) {
+            stalled = 1;
+            statAdd(&Stats->stalled, 1);
+            statAdd(&Stats->stalls, 1);
+        }
+        if (shouldEvict(calcTDiff(start))) {
+            evicted = 1;
+            break;
+        }
+    }
+    
+    if (stalled) {
+        statAdd(&Stats->stalled, -1);
+        statAdd(&Stats->stallMs, calcTDiff(start));
+    }
+    if (evicted) {
+        statAdd(&Stats->evictions, 1);
+        printf("Evicting client stalled for %ldms\n", calcTDiff(start));
+        // Takes the connection process off the client too
+        shutdown(sock, SHUT_RDWR);
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return 0;
+}
+
+// Sends iovcnt iovecs in full with one sendmsg per pass, picking up after partial sends.
+// Returns -1 if the client has gone or was evicted for not reading.
+int sendAll(int sock, struct iovec *iov, int iovcnt) {
+    struct msghdr msg = {0};
+    
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable(sock) == 0) {
+                continue;
+            }
+            return -1;
+        }
+        statAdd(&Stats->bytesSent, sent);
+        
+        // Skip what went out, part of an iovec may be left over
+        while (iovcnt > 0 && (size_t) sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    
+    return 0;
+}
+
+// Frame header: type then payload length, both in network order
+void encodeFrameHeader(char *header, int type, uint32_t len) {
+    uint32_t fields[2] = {htonl(type), htonl(len)};
+    memcpy(header, fields, FRAME_HEADER_LEN);
+}
+
+// Compression codecs, the best one both ends have is picked by hello
+const char *codecNames[] = {"none", "lz", "zlib"};
+
+// Reads 4 bytes whatever their alignment
+uint32_t read32(const unsigned char *p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+// Writes an LZ length that didn't fit in its 4 bits of the token as 255s and a remainder
+int lzWriteLength(unsigned char *out, int op, int outCap, int len) {
+    for (; len >= 255; len -= 255) {
+        if (op >= outCap) {
+            return -1;
+        }
+        out[op++] = 255;
+    }
+    if (op >= outCap) {
+        return -1;
+    }
+    out[op++] = (unsigned char) len;
+    return op;
+}
+
+// Writes a sequence: token, literals, then unless it's the last a 2 byte offset and the match length
+int lzWriteSequence(unsigned char *out, int op, int outCap, const unsigned char *literals, int litLen, int offset, int matchLen) {
+    int matchCode = matchLen - LZ_MIN_MATCH;
+    
+    if (op >= outCap) {
+        return -1;
+    }
+    out[op++] = (unsigned char) (((litLen < 15 ? litLen : 15) << 4) | (offset > 0 ? (matchCode < 15 ? matchCode : 15) : 0));
+    if (litLen >= 15 && (op = lzWriteLength(out, op, outCap, litLen - 15)) < 0) {
+        return -1;
+    }
+    if (op + litLen > outCap) {
+        return -1;
+    }
+    memcpy(out + op, literals, litLen);
+    op += litLen;
+    
+    if (offset > 0) {
+        if (op + 2 > outCap) {
+            return -1;
+        }
+        out[op++] = (unsigned char) offset;
+        out[op++] = (unsigned char) (offset >> 8);
+        if (matchCode >= 15 && (op = lzWriteLength(out, op, outCap, matchCode - 15)) < 0) {
+            return -1;
+        }
+    }
+    return op;
+}
+
+// The built in codec, an LZ77 in the style of LZ4: runs of literals and copies from
+// up to 64KB back, found through a hash of every 4 bytes. Returns the compressed
+// length, or -1 if it needs more than outCap bytes.
+int lzCompress(const unsigned char *in, int inLen, unsigned char *out, int outCap) {
+    int table[1 << LZ_HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+    
+    memset(table, 0xff, sizeof(table));
+    
+    while (ip + LZ_MIN_MATCH <= inLen) {
+        uint32_t sequence = read32(in + ip);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[hash];
+        table[hash] = ip;
+        
+        if (ref < 0 || ip - ref > 65535 || read32(in + ref) != sequence) {
+            ip++;
+            continue;
+        }
+        
+        int matchLen = LZ_MIN_MATCH;
+        while (ip + matchLen < inLen && in[ref + matchLen] == in[ip + matchLen]) {
+            matchLen++;
+        }
+        
+        op = lzWriteSequence(out, op, outCap, in + anchor, ip - anchor, ip - ref, matchLen);
+        if (op < 0) {
+            return -1;
+        }
+        ip += matchLen;
+        anchor = ip;
+    }
+    
+    // Always ends with a sequence of just literals, maybe none
+    return lzWriteSequence(out, op, outCap, in + anchor, inLen - anchor, 0, 0);
+}
+
+// Reads an extended LZ length, -1 if it runs off the end of the input
+int lzReadLength(const unsigned char *in, int inLen, int *ip) {
+    int len = 0;
+    unsigned char byte;
+    do {
+        if (*ip >= inLen) {
+            return -1;
+        }
+        byte = in[(*ip)++];
+        len += byte;
+    } while (byte == 255);
+    return len;
+}
+
+// Returns the decompressed length, or -1 if the input is corrupt or won't fit in outCap
+int lzDecompress(const unsigned char *in, int inLen, unsigned char *out, int outCap) {
+    int ip = 0, op = 0;
+    
+    while (ip < inLen) {
+        int token = in[ip++];
+        int litLen = token >> 4;
+        if (litLen == 15) {
+            int extra = lzReadLength(in, inLen, &ip);
+            if (extra < 0) {
+                return -1;
+            }
+            litLen += extra;
+        }
+        if (ip + litLen > inLen || op + litLen > outCap) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, litLen);
+        ip += litLen;
+        op += litLen;
+        
+        // The last sequence has no match
+        if (ip >= inLen) {
+            break;
+        }
+        
+        if (ip + 2 > inLen) {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int matchLen = token & 15;
+        if (matchLen == 15) {
+            int extra = lzReadLength(in, inLen, &ip);
+            if (extra < 0) {
+                return -1;
+            }
+            matchLen += extra;
+        }
+        matchLen += LZ_MIN_MATCH;
+        
+        if (offset == 0 || offset > op || op + matchLen > outCap) {
+            return -1;
+        }
+        // Byte at a time as the copy can overlap what it's writing
+        for (int i = 0; i < matchLen; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+    
+    return op;
+}
+
+// Compresses with codec, returns the length or -1 if it doesn't fit in outCap
+int compressChunk(int codec, const unsigned char *in, int inLen, unsigned char *out, int outCap) {
+    if (codec == CODEC_LZ) {
+        return lzCompress(in, inLen, out, outCap);
+    }
+#ifdef HAVE_ZLIB
+    if (codec == CODEC_ZLIB) {
+        uLongf outLen = outCap;
+        return compress2(out, &outLen, in, inLen, 1) == Z_OK ? (int) outLen : -1;
+    }
+#endif
+    return -1;
+}
+
+// Decompresses with codec, returns the length or -1 if the data is bad
+int decompressChunk(int codec, const unsigned char *in, int inLen, unsigned char *out, int outCap) {
+    if (codec == CODEC_LZ) {
+        return lzDecompress(in, inLen, out, outCap);
+    }
+#ifdef HAVE_ZLIB
+    if (codec == CODEC_ZLIB) {
+        uLongf outLen = outCap;
+        return uncompress(out, &outLen, in, inLen) == Z_OK ? (int) outLen : -1;
+    }
+#endif
+    return -1;
+}
+
+// CPU time used by this process so far, for the cost of compression
+long cpuTimeNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Packs a chunk of type into out as the payload of a COMPRESSED frame.
+// Returns the payload length, or 0 to send the chunk as it is.
+int packChunk(int type, const char *data, int len, unsigned char *out) {
+    if (Codec == CODEC_NONE || len < COMPRESS_MIN_LEN) {
+        return 0;
+    }
+    
+    Compression.rawOut += len;
+    
+    // Mostly incompressible so far, only try now and then
+    if (Compression.misses >= COMPRESS_MAX_MISSES && Compression.misses++ % COMPRESS_RETRY_EVERY != 0) {
+        Compression.packedOut += len;
+        Compression.rawChunks++;
+        return 0;
+    }
+    
+    // Not worth it unless it saves an eighth
+    long before = cpuTimeNs();
+    int packed = compressChunk(Codec, (const unsigned char *) data, len, out + COMPRESS_HEADER_LEN, len - len / 8 - COMPRESS_HEADER_LEN);
+    Compression.cpuNs += cpuTimeNs() - before;
+    
+    if (packed < 0) {
+        Compression.packedOut += len;
+        Compression.rawChunks++;
+        Compression.misses++;
+        return 0;
+    }
+    
+    uint32_t originalLen = htonl(len);
+    out[0] = (unsigned char) type;
+    memcpy(out + 1, &originalLen, 4);
+    
+    Compression.packedOut += packed + COMPRESS_HEADER_LEN;
+    Compression.chunks++;
+    Compression.misses = 0;
+    return packed + COMPRESS_HEADER_LEN;
+}
+
+// Unpacks a COMPRESSED frame's payload into out. Returns the original length
+// with the original type in type, or -1 if it's corrupt.
+int unpackChunk(const unsigned char *in, int len, int *type, unsigned char *out, int outCap) {
+    uint32_t originalLen;
+    
+    if (len < COMPRESS_HEADER_LEN) {
+        return -1;
+    }
+    memcpy(&originalLen, in + 1, 4);
+    originalLen = ntohl(originalLen);
+    if (originalLen > (uint32_t) outCap) {
+        return -1;
+    }
+    
+    long before = cpuTimeNs();
+    int unpacked = decompressChunk(Codec, in + COMPRESS_HEADER_LEN, len - COMPRESS_HEADER_LEN, out, (int) originalLen);
+    Compression.cpuNs += cpuTimeNs() - before;
+    
+    if (unpacked != (int) originalLen) {
+        return -1;
+    }
+    *type = in[0];
+    Compression.rawIn += unpacked;
+    Compression.packedIn += len;
+    return unpacked;
+}
+
+// Takes a segment from the pool, or mallocs one if the pool is empty
+struct Segment *getSegment(int type) {
+    struct Segment *segment = SegmentPool;
+    
+    if (segment != NULL) {
+        SegmentPool = segment->next;
+        SegmentPoolSize--;
+    } else {
+        segment = malloc(sizeof(struct Segment));
+        if (segment == NULL) {
+            perror("Unable to allocate response");
+            exit(1);
+        }
+    }
+    
+    segment->type = type;
+    segment->len = 0;
+    segment->next = NULL;
+    return segment;
+}
+
+// Returns a sent segment to the pool
+void releaseSegment(struct Segment *segment) {
+    // No more than a full reply's worth stays around between replies
+    if (SegmentPoolSize >= RESP_POOL_MAX || SegmentPoolSize * SEGMENT_LEN >= Config.connBudget) {
+        free(segment);
+        return;
+    }
+    segment->next = SegmentPool;
+    SegmentPool = segment;
+    SegmentPoolSize++;
+}
+
+// Counts n more (or fewer) bytes buffered against the reply's and the global budget
+void respAccount(struct Response *resp, long n) {
+    resp->buffered += n;
+    statsBuffered(n);
+}
+
+void respInit(struct Response *resp, int sock) {
+    resp->sock = sock;
+    resp->head = NULL;
+    resp->tail = NULL;
+    resp->buffered = 0;
+}
+
+// Sends everything buffered so far, one frame per segment in as few sendmsg calls as possible.
+// With a codec each segment is compressed on its own, those that don't shrink going as they are.
+void respFlush(struct Response *resp) {
+    static unsigned char *packed[RESP_IOV_BATCH];
+    char headers[RESP_IOV_BATCH][FRAME_HEADER_LEN];
+    struct iovec iov[RESP_IOV_BATCH * 2];
+    
+    while (resp->head != NULL) {
+        int n = 0;
+        struct Segment *segment = resp->head;
+        
+        while (segment != NULL && n < RESP_IOV_BATCH) {
+            int packedLen = 0;
+            if (Codec != CODEC_NONE) {
+                if (packed[n] == NULL) {
+                    packed[n] = malloc(SEGMENT_LEN);
+                }
+                // Without a buffer to compress into the segment goes as it is
+                if (packed[n] != NULL) {
+                    packedLen = packChunk(segment->type, segment->data, (int) segment->len, packed[n]);
+                }
+            }
+            
+            if (packedLen > 0) {
+                encodeFrameHeader(headers[n], FRAME_COMPRESSED, (uint32_t) packedLen);
+                iov[2 * n + 1].iov_base = packed[n];
+                iov[2 * n + 1].iov_len = packedLen;
+            } else {
+                encodeFrameHeader(headers[n], segment->type, (uint32_t) segment->len);
+                iov[2 * n + 1].iov_base = segment->data;
+                iov[2 * n + 1].iov_len = segment->len;
+            }
+            iov[2 * n].iov_base = headers[n];
+            iov[2 * n].iov_len = FRAME_HEADER_LEN;
+            n++;
+            segment = segment->next;
+        }
+        
+        if (sendAll(resp->sock, iov, n * 2) < 0) {
+            perror("send failed with error:");
+            close(resp->sock);
+            exit(1);
+        }
+        
+        for (int i = 0; i < n; i++) {
+            segment = resp->head;
+            resp->head = segment->next;
+            releaseSegment(segment);
+        }
+    }
+    
+    resp->tail = NULL;
+    respAccount(resp, -(long) resp->buffered);
+}
+
+// Room at the end of the response for at least one byte of type
+struct Segment *respTail(struct Response *resp, int type) {
+    if (resp->tail == NULL || resp->tail->type != type || resp->tail->len == SEGMENT_LEN) {
+        // Send what this reply has before it takes more of an exhausted global budget
+        if (resp->buffered > 0 && statLoad(&Stats->buffered) + SEGMENT_LEN > Config.globalBudget) {
+            statAdd(&Stats->budgetFlushes, 1);
+            respFlush(resp);
+        }
+        
+        struct Segment *segment = getSegment(type);
+        if (resp->tail == NULL) {
+            resp->head = segment;
+        } else {
+            resp->tail->next = segment;
+        }
+        resp->tail = segment;
+    }
+    return resp->tail;
+}
+
+// Appends len bytes of type to the response, flushing once enough is buffered
+void respAppendType(struct Response *resp, int type, const char *data, size_t len) {
+    while (len > 0) {
+        struct Segment *segment = respTail(resp, type);
+        size_t space = SEGMENT_LEN - segment->len;
+        size_t n = len < space ? len : space;
+        
+        memcpy(segment->data + segment->len, data, n);
+        segment->len += n;
+        respAccount(resp, n);
+        data += n;
+        len -= n;
+        
+        if ((long) resp->buffered >= Config.connBudget) {
+            respFlush(resp);
+        }
+    }
+}
+
+// Appends a frame of type with no payload, a signal to the client
+void respMarker(struct Response *resp, int type) {
+    struct Segment *segment = getSegment(type);
+    if (resp->tail == NULL) {
+        resp->head = segment;
+    } else {
+        resp->tail->next = segment;
+    }
+    resp->tail = segment;
+}
+
+// Appends output that is the result of the command
+void respAppend(struct Response *resp, const char *data, size_t len) {
+    respAppendType(resp, FRAME_DATA, data, len);
+}
+
+// Appends a formatted message from the server, timings and errors etc
+void respInfo(struct Response *resp, const char *format, ...) {
+    char buffer[BUFLEN];
+    char *text = buffer;
+    va_list args;
+    
+    va_start(args, format);
+    int len = vsnprintf(buffer, BUFLEN, format, args);
+    va_end(args);
+    
+    // Too long for the stack buffer, format it again into one that fits
+    if (len >= BUFLEN) {
+        text = malloc(len + 1);
+        va_start(args, format);
+        vsnprintf(text, len + 1, format, args);
+        va_end(args);
+    }
+    
+    if (len > 0) {
+        respAppendType(resp, FRAME_INFO, text, len);
+    }
+    if (text != buffer) {
+        free(text);
+    }
+}
+
+// Reads fd until EOF straight into the response's buffers, returns the bytes read.
+// The first copyMax bytes are also written to copyFd unless it's -1.
+long respCopyFd(struct Response *resp, int type, int fd, int copyFd, long copyMax) {
+    long total = 0;
+    
+    while (1) {
+        struct Segment *segment = respTail(resp, type);
+        ssize_t bytesRead = read(fd, segment->data + segment->len, SEGMENT_LEN - segment->len);
+        
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            break;
+        }
+        
+        if (copyFd >= 0 && total + bytesRead <= copyMax) {
+            write(copyFd, segment->data + segment->len, bytesRead);
+        }
+        segment->len += bytesRead;
+        respAccount(resp, bytesRead);
+        total += bytesRead;
+        
+        // Nothing more is read from fd until this is sent
+        if ((long) resp->buffered >= Config.connBudget) {
+            respFlush(resp);
+        }
+    }
+    
+    return total;
+}
+
+long respAppendFd(struct Response *resp, int type, int fd) {
+    return respCopyFd(resp, type, fd, -1, 0);
+}
+
+// Passes fd to a local client, after everything appended before it
+void respSendFd(struct Response *resp, int fd) {
+    char header[FRAME_HEADER_LEN];
+    
+    respFlush(resp);
+    encodeFrameHeader(header, FRAME_FD, 0);
+    if (sendWithFds(resp->sock, header, FRAME_HEADER_LEN, &fd, 1) < 0) {
+        perror("sendmsg failed with error:");
+        close(resp->sock);
+        exit(1);
+    }
+}
+
+// Sends what's buffered then reports how compression did for this command so far
+void respCompressionStats(struct Response *resp) {
+    respFlush(resp);
+    
+    if (Compression.rawOut == 0 && Compression.rawIn == 0) {
+        return;
+    }
+    respInfo(resp, "Compression (%s): ", codecNames[Codec]);
+    if (Compression.rawOut > 0) {
+        respInfo(resp, "sent %ld -> %ld bytes (%.1fx, %d chunks compressed, %d raw), ", Compression.rawOut, Compression.packedOut,
+                 (double) Compression.rawOut / Compression.packedOut, Compression.chunks, Compression.rawChunks);
+    }
+    if (Compression.rawIn > 0) {
+        respInfo(resp, "received %ld -> %ld bytes (%.1fx), ", Compression.packedIn, Compression.rawIn, (double) Compression.rawIn / Compression.packedIn);
+    }
+    respInfo(resp, "%.2fms CPU\n", Compression.cpuNs / 1e6);
+}
+
+// Sends the rest of the response and the frame that ends it
+void respEnd(struct Response *resp) {
+    char header[FRAME_HEADER_LEN];
+    struct iovec iov = {header, FRAME_HEADER_LEN};
+    struct timespec sendStart;
+    clock_gettime(CLOCK_REALTIME, &sendStart);
+    
+    respFlush(resp);
+    encodeFrameHeader(header, FRAME_END, 0);
+    if (sendAll(resp->sock, &iov, 1) < 0) {
+        perror("send failed with error:");
+        close(resp->sock);
+        exit(1);
+    }
+    traceSince("send complete", &sendStart, NULL);
+}
+
+// Sends a whole response that is just a message from the server
+void send_to_client(int ClientSocket, const char *message) {
+    struct Response resp;
+    respInit(&resp, ClientSocket);
+    respInfo(&resp, "%s", message);
+    respEnd(&resp);
+}
+
+// Sends buffer over a unix socket along with nfds file descriptors
+int sendWithFds(int sock, void *buffer, size_t len, int *fds, int nfds) {
+    struct msghdr msg = {0};
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int) * PASS_MAX_FDS)];
+    
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    
+    if (nfds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    
+    return (int) sendmsg(sock, &msg, 0);
+}
+
+// Receives into buffer from a unix socket, storing up to maxfds passed
+// file descriptors in fds and their count in nfds
+int recvWithFds(int sock, void *buffer, size_t len, int *fds, int maxfds, int *nfds) {
+    struct msghdr msg = {0};
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int) * PASS_MAX_FDS)];
+    
+    iov.iov_base = buffer;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    *nfds = 0;
+    int iResult = (int) recvmsg(sock, &msg, 0);
+    if (iResult < 0) {
+        return iResult;
+    }
+    
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            int *passed = (int *) CMSG_DATA(cmsg);
+            for (int i = 0; i < count; i++) {
+                if (*nfds < maxfds) {
+                    fds[(*nfds)++] = passed[i];
+                } else {
+                    close(passed[i]);
+                }
+            }
+        }
+    }
+    
+    return iResult;
+}
+
+void setCloseOnExec(int fd) {
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+// Puts outFd on stdout and stderr, inFd (or /dev/null) on stdin and execs
+// argv in dir. Only returns by exiting if the exec fails.
+void execProgram(struct SpawnRequest *request, int outFd, int inFd) {
+    char *argv[64] = {0, };
+    int argc = 0;
+    
+    // Unpack the NUL separated arguments
+    for (int i = 0; i < request->argvLen && argc < 63; i += (int) strlen(&request->argv[i]) + 1) {
+        argv[argc++] = &request->argv[i];
+    }
+    
+    if (inFd < 0) {
+        inFd = open("/dev/null", O_RDONLY);
+    }
+    
+    dup2(inFd, STDIN_FILENO);
+    dup2(outFd, STDOUT_FILENO);
+    dup2(outFd, STDERR_FILENO);
+    if (inFd > STDERR_FILENO) {
+        close(inFd);
+    }
+    if (outFd > STDERR_FILENO) {
+        close(outFd);
+    }
+    
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    
+    if (chdir(request->dir) == 0) {
+        execv(argv[0], argv);
+    }
+    
+    printf("Unable to run %s: %s\n", argv[0], strerror(errno));
+    fflush(stdout);
+    _exit(127);
+}
+
+// A warm zygote child: already forked, waits for one request and execs it
+void warmChildLoop(int sock) {
+    struct SpawnRequest request;
+    int fds[SPAWN_MAX_FDS];
+    int nfds = 0;
+    
+    if (recvWithFds(sock, &request, sizeof(request), fds, SPAWN_MAX_FDS, &nfds) <= 0 || nfds < 1) {
+        _exit(1);
+    }
+    close(sock);
+    
+    execProgram(&request, fds[0], nfds > 1 ? fds[1] : -1);
+}
+
+// Forks a new warm child for the pool
+int forkWarmChild(struct WarmChild *child) {
+    int sv[2];
+    
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+        perror("Zygote socketpair failed with error");
+        return -1;
+    }
+    setCloseOnExec(sv[0]);
+    setCloseOnExec(sv[1]);
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        warmChildLoop(sv[1]);
+    } else if (pid < 0) {
+        perror("Zygote fork failed with error");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    
+    close(sv[1]);
+    child->pid = pid;
+    child->sock = sv[0];
+    return 0;
+}
+
+int zygoteSigPipe[2];
+
+// Wakes up the zygote's poll when a child exits
+void zygote_sig_child(int signum) {
+    int savedErrno = errno;
+    write(zygoteSigPipe[1], "c", 1);
+    errno = savedErrno;
+}
+
+// The zygote: a small process forked before the server grows that launches
+// programs for request handlers from a pool of warm children. Each request
+// carries a reply socket which gets the pid when the program starts and its
+// wait status when it exits.
+void zygoteLoop(int sock, pid_t serverPid) {
+    struct WarmChild pool[ZYGOTE_POOL_SIZE];
+    int poolSize = 0;
+    
+    // Reply sockets of the programs still running, indexed alongside their pids
+    pid_t *runningPids = NULL;
+    int *runningReplies = NULL;
+    int noRunning = 0, runningCap = 0;
+    
+    signal(SIGPIPE, SIG_IGN);
+    pipe(zygoteSigPipe);
+    setCloseOnExec(zygoteSigPipe[0]);
+    setCloseOnExec(zygoteSigPipe[1]);
+    fcntl(zygoteSigPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(zygoteSigPipe[1], F_SETFL, O_NONBLOCK);
+    signal(SIGCHLD, zygote_sig_child);
+    
+    while (poolSize < ZYGOTE_POOL_SIZE && forkWarmChild(&pool[poolSize]) == 0) {
+        poolSize++;
+    }
+    
+    while (1) {
+        struct pollfd pfds[2] = {{sock, POLLIN, 0}, {zygoteSigPipe[0], POLLIN, 0}};
+        int iResult = poll(pfds, 2, 1000);
+        
+        // Exit along with the server
+        if (getppid() != serverPid) {
+            for (int i = 0; i < poolSize; i++) {
+                kill(pool[i].pid, SIGKILL);
+            }
+            _exit(0);
+        }
+        
+        if (iResult < 0) {
+            continue;
+        }
+        
+        if (pfds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(zygoteSigPipe[0], drain, sizeof(drain)) > 0);
+            
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int i = 0; i < noRunning; i++) {
+                    if (runningPids[i] == pid) {
+                        struct SpawnReply reply = {pid, status, 1};
+                        write(runningReplies[i], &reply, sizeof(reply));
+                        close(runningReplies[i]);
+                        noRunning--;
+                        runningPids[i] = runningPids[noRunning];
+                        runningReplies[i] = runningReplies[noRunning];
+                        break;
+                    }
+                }
+                // Replace warm children that died before being used
+                for (int i = 0; i < poolSize; i++) {
+                    if (pool[i].pid == pid) {
+                        close(pool[i].sock);
+                        pool[i] = pool[--poolSize];
+                        break;
+                    }
+                }
+            }
+        }
+        
+        if (pfds[0].revents & POLLIN) {
+            struct SpawnRequest request;
+            int fds[PASS_MAX_FDS];
+            int nfds = 0;
+            
+            if (recvWithFds(sock, &request, sizeof(request), fds, PASS_MAX_FDS, &nfds) > 0 && nfds >= 2) {
+                // fds[0] is the reply socket, the rest go to the program
+                int replyFd = fds[0];
+                setCloseOnExec(replyFd);
+                
+                if (poolSize == 0 && forkWarmChild(&pool[0]) == 0) {
+                    poolSize = 1;
+                }
+                
+                struct SpawnReply reply = {-1, 0, 1};
+                if (poolSize > 0) {
+                    struct WarmChild child = pool[--poolSize];
+                    if (sendWithFds(child.sock, &request, sizeof(request), &fds[1], nfds - 1) > 0) {
+                        reply.pid = child.pid;
+                        reply.exited = 0;
+                    } else {
+                        kill(child.pid, SIGKILL);
+                    }
+                    close(child.sock);
+                }
+                
+                for (int i = 1; i < nfds; i++) {
+                    close(fds[i]);
+                }
+                
+                write(replyFd, &reply, sizeof(reply));
+                if (reply.exited == 0) {
+                    if (noRunning == runningCap) {
+                        runningCap = runningCap == 0 ? 16 : runningCap * 2;
+                        runningPids = realloc(runningPids, runningCap * sizeof(pid_t));
+                        runningReplies = realloc(runningReplies, runningCap * sizeof(int));
+                    }
+                    runningPids[noRunning] = reply.pid;
+                    runningReplies[noRunning] = replyFd;
+                    noRunning++;
+                } else {
+                    close(replyFd);
+                }
+            } else {
+                for (int i = 0; i < nfds; i++) {
+                    close(fds[i]);
+                }
+            }
+            
+            // Top the pool back up now the launch is out of the way
+            while (poolSize < ZYGOTE_POOL_SIZE && forkWarmChild(&pool[poolSize]) == 0) {
+                poolSize++;
+            }
+        }
+    }
+}
+
+// Forks the zygote, must be called before the server allocates much so
+// that the zygote and its warm children stay small
+void zygoteStartup(void) {
+    int sv[2];
+    pid_t serverPid = getpid();
+    
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0) {
+        perror("Zygote socketpair failed with error");
+        return;
+    }
+    setCloseOnExec(sv[0]);
+    setCloseOnExec(sv[1]);
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        zygoteLoop(sv[1], serverPid);
+    } else if (pid < 0) {
+        perror("Zygote fork failed with error");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    
+    close(sv[1]);
+    ZygoteSocket = sv[0];
+    printf("Zygote started with pid %d\n", pid);
+}
+
+// Launches argv in dir with stdout and stderr going to outFd and stdin from inFd,
+// or /dev/null if inFd is -1. Goes through the zygote when it is available and
+// forks here otherwise. replyFd is left open for waitProgram to collect the exit status.
+pid_t spawnProgram(const char *dir, char **argv, int outFd, int inFd, int *replyFd) {
+    struct SpawnRequest request = {0};
+    snprintf(request.dir, BUFLEN, "%s", dir);
+    
+    for (int i = 0; argv[i] != NULL; i++) {
+        int len = (int) strlen(argv[i]) + 1;
+        if (request.argvLen + len > BUFLEN) {
+            break;
+        }
+        memcpy(&request.argv[request.argvLen], argv[i], len);
+        request.argvLen += len;
+    }
+    
+    *replyFd = -1;
+    
+    if (ZygoteSocket >= 0) {
+        int sv[2];
+        struct SpawnReply reply;
+        
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+            int fds[3] = {sv[1], outFd, inFd};
+            int iResult = sendWithFds(ZygoteSocket, &request, sizeof(request), fds, inFd >= 0 ? 3 : 2);
+            close(sv[1]);
+            
+            if (iResult > 0 && read(sv[0], &reply, sizeof(reply)) == sizeof(reply) && reply.pid > 0) {
+                *replyFd = sv[0];
+                return reply.pid;
+            }
+            close(sv[0]);
+        }
+        printf("Zygote unavailable, forking directly\n");
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        execProgram(&request, outFd, inFd);
+    }
+    return pid;
+}
+
+// Waits for a program started by spawnProgram and returns its wait status
+int waitProgram(pid_t pid, int replyFd) {
+    int status = -1;
+    
+    if (replyFd >= 0) {
+        struct SpawnReply reply;
+        if (read(replyFd, &reply, sizeof(reply)) == sizeof(reply)) {
+            status = reply.status;
+        }
+        close(replyFd);
+    } else if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+    
+    return status;
+}
+
+// SHA-256, used to tell whether the client's files differ from ours
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t len;
+    unsigned char block[64];
+    size_t used;
+};
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256Init(struct Sha256 *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->len = 0;
+    ctx->used = 0;
+}
+
+void sha256Block(struct Sha256 *ctx, const unsigned char *block) {
+    uint32_t w[64];
+    uint32_t s[8];
+    
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[4 * i] << 24) | ((uint32_t) block[4 * i + 1] << 16) | ((uint32_t) block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    
+    memcpy(s, ctx->state, sizeof(s));
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = s[7] + (ROTR32(s[4], 6) ^ ROTR32(s[4], 11) ^ ROTR32(s[4], 25)) + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256K[i] + w[i];
+        uint32_t t2 = (ROTR32(s[0], 2) ^ ROTR32(s[0], 13) ^ ROTR32(s[0], 22)) + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        memmove(s + 1, s, 7 * sizeof(uint32_t));
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) {
+        ctx->state[i] += s[i];
+    }
+}
+
+void sha256Update(struct Sha256 *ctx, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    ctx->len += len;
+    
+    while (len > 0) {
+        size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, bytes, n);
+        ctx->used += n;
+        bytes += n;
+        len -= n;
+        
+        if (ctx->used == 64) {
+            sha256Block(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256Final(struct Sha256 *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->len * 8;
+    unsigned char pad = 0x80;
+    
+    sha256Update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56) {
+        sha256Update(ctx, &pad, 1);
+    }
+    for (int i = 7; i >= 0; i--) {
+        unsigned char byte = (unsigned char) (bits >> (8 * i));
+        sha256Update(ctx, &byte, 1);
+    }
+    
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (unsigned char) (ctx->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char) (ctx->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char) (ctx->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char) ctx->state[i];
+    }
+}
+
+// Hashes len bytes of data in one go
+void sha256(const void *data, size_t len, unsigned char *digest) {
+    struct Sha256 ctx;
+    sha256Init(&ctx);
+    sha256Update(&ctx, data, len);
+    sha256Final(&ctx, digest);
+}
+
+// Writes a digest as HASH_HEX_LEN hex characters and a NUL
+void hashToHex(const unsigned char *digest, char *hex) {
+    for (int i = 0; i < HASH_LEN; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+// rsync's rolling checksum of a block, two 16 bit sums
+uint32_t weakChecksum(const unsigned char *data, size_t len) {
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t) (len - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Receives exactly len bytes from the client, returns -1 if the connection is gone
+int receiveAll(int ClientSocket, void *buffer, size_t len) {
+    size_t received = 0;
+    
+    while (received < len) {
+        ssize_t n = recv(ClientSocket, (char *) buffer + received, len - received, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+        statAdd(&Stats->bytesReceived, n);
+    }
+    return 0;
+}
+
+// Receives a frame sent by the client into buffer, which holds up to cap bytes,
+// decompressing it if the client compressed it. Returns the payload length with
+// the frame's type in type. A frame that doesn't fit means the client is out of
+// step, so the connection is dropped.
+int receiveFrame(int ClientSocket, int *type, void *buffer, uint32_t cap) {
+    uint32_t fields[2];
+    
+    if (receiveAll(ClientSocket, fields, FRAME_HEADER_LEN) < 0) {
+        printf("Connection Closed\n");
+        exit(1);
+    }
+    *type = (int) ntohl(fields[0]);
+    uint32_t len = ntohl(fields[1]);
+    
+    if (len > cap) {
+        printf("Frame of %u bytes from client is too big\n", len);
+        close(ClientSocket);
+        exit(1);
+    }
+    if (*type != FRAME_COMPRESSED) {
+        if (receiveAll(ClientSocket, buffer, len) < 0) {
+            printf("Connection Closed\n");
+            exit(1);
+        }
+        return (int) len;
+    }
+    
+    unsigned char *packed = malloc(len);
+    if (packed == NULL || receiveAll(ClientSocket, packed, len) < 0) {
+        printf("Connection Closed\n");
+        exit(1);
+    }
+    int unpacked = unpackChunk(packed, (int) len, type, buffer, (int) cap);
+    free(packed);
+    if (unpacked < 0) {
+        printf("Corrupt compressed frame from client\n");
+        close(ClientSocket);
+        exit(1);
+    }
+    return unpacked;
+}
+
+// Reads all of path into a malloc'd buffer, NULL if it can't be read
+unsigned char *readWholeFile(const char *path, long *size) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || S_ISREG(st.st_mode) == 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    // One spare byte so that empty files still get a buffer
+    unsigned char *data = malloc(st.st_size + 1);
+    long total = 0;
+    while (data != NULL && total < st.st_size) {
+        ssize_t n = read(fd, data + total, st.st_size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+    
+    *size = total;
+    return data;
+}
+
+// Absolute path of the blob store, set in main
+char BlobDir[BUFLEN] = "";
+
+// Path of the blob holding content with hash, BLOB_DIR/ab/abcd...
+void blobPath(const char *hash, char *path, int len) {
+    snprintf(path, len, "%s%.2s/%s", BlobDir, hash, hash);
+}
+
+int hasBlob(const char *hash) {
+    char path[BUFLEN] = {0, };
+    blobPath(hash, path, BUFLEN);
+    return access(path, F_OK) == 0;
+}
+
+// A fresh file in the store's tmp directory for content that will become a blob
+int createBlobTemp(const char *hash, char *tempPath, int len) {
+    snprintf(tempPath, len, "%s%s/%s.%d", BlobDir, BLOB_TMP_DIR, hash, getpid());
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Unable to create blob");
+    }
+    return fd;
+}
+
+// Shared while storing and linking blobs, exclusive while collecting unused ones
+int lockBlobs(int operation) {
+    char path[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%s", BlobDir, BLOB_LOCK_FILE);
+    
+    int lockFd = open(path, O_RDWR | O_CREAT, 0644);
+    if (lockFd < 0) {
+        perror("Unable to open blob lock");
+        return -1;
+    }
+    setCloseOnExec(lockFd);
+    
+    while (flock(lockFd, operation) < 0 && errno == EINTR);
+    return lockFd;
+}
+
+// Moves a verified temp file into the store as hash's blob. If the blob is
+// already there the temp file is dropped and the existing one kept.
+int storeBlob(const char *tempPath, const char *hash) {
+    char path[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%.2s", BlobDir, hash);
+    mkdir(path, 0755);
+    
+    blobPath(hash, path, BUFLEN);
+    if (access(path, F_OK) == 0) {
+        unlink(tempPath);
+        return 0;
+    }
+    if (chmod(tempPath, BLOB_MODE) < 0 || rename(tempPath, path) < 0) {
+        perror("Unable to store blob");
+        unlink(tempPath);
+        return -1;
+    }
+    return 0;
+}
+
+// Copies blob to a new file at path, as a reflink sharing the blob's data where
+// the filesystem can. Either way path is a file of its own, so writing to it
+// never changes the blob or another progname's copy.
+int copyBlob(const char *blob, const char *path) {
+    int in = open(blob, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    
+    int failed = 0;
+#ifdef __linux__
+    if (ioctl(out, FICLONE, in) == 0) {
+        close(in);
+        close(out);
+        return 0;
+    }
+#endif
+    
+    char buffer[SYNC_CHUNK_LEN];
+    ssize_t len;
+    while ((len = read(in, buffer, sizeof(buffer))) != 0) {
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 || write(out, buffer, len) != len) {
+            failed = 1;
+            break;
+        }
+    }
+    close(in);
+    if (close(out) < 0 || failed) {
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+// Copies hash's blob to a temporary name next to path, set in tempPath, for
+// renaming over path. tempPath is left empty if path has that content already.
+int stageBlob(const char *hash, const char *path, char *tempPath, int len) {
+    char blob[BUFLEN] = {0, };
+    
+    blobPath(hash, blob, BUFLEN);
+    tempPath[0] = '\0';
+    
+    // Left alone if unchanged so that run doesn't rebuild, unless it's the blob
+    // itself, hardlinked by servers from before prognames got copies
+    struct stat blobStat, pathStat;
+    if (stat(blob, &blobStat) == 0 && stat(path, &pathStat) == 0 && blobStat.st_size == pathStat.st_size
+        && (blobStat.st_ino != pathStat.st_ino || blobStat.st_dev != pathStat.st_dev)) {
+        long size = 0;
+        unsigned char *data = readWholeFile(path, &size);
+        unsigned char digest[HASH_LEN];
+        char hex[HASH_HEX_LEN + 1];
+        
+        if (data != NULL) {
+            sha256(data, size, digest);
+            hashToHex(digest, hex);
+            free(data);
+            if (strcmp(hex, hash) == 0) {
+                return 0;
+            }
+        }
+    }
+    
+    snprintf(tempPath, len, "%s.copy.%d", path, getpid());
+    if (copyBlob(blob, tempPath) < 0) {
+        perror("Unable to copy blob");
+        tempPath[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+// Replaces path with a copy of hash's blob, atomically so that a build
+// reading the old file never sees a missing one
+int placeBlob(const char *hash, const char *path) {
+    char tempPath[BUFLEN] = {0, };
+    
+    if (stageBlob(hash, path, tempPath, BUFLEN) < 0) {
+        return -1;
+    }
+    if (tempPath[0] != '\0' && rename(tempPath, path) < 0) {
+        perror("Unable to move copied blob into place");
+        unlink(tempPath);
+        return -1;
+    }
+    return 0;
+}
+
+// An upload of one blob. Its content goes to BLOB_TMP_DIR/hash.part, which
+// outlives a dropped connection so that the next put of the file can carry on
+// where this one stopped.
+struct BlobUpload {
+    int fd;
+    long offset;
+    char tempPath[BUFLEN];
+    // Hash of the first offset bytes, carried on with the rest
+    struct Sha256 ctx;
+    char prefixHash[HASH_HEX_LEN + 1];
+};
+
+// Opens hash's partial upload, locked so only one connection writes it.
+// If another connection has it, this upload goes to a file of its own.
+// A partial that is no shorter than the whole file is thrown away.
+void openBlobUpload(const char *hash, long size, struct BlobUpload *upload) {
+    struct stat st;
+    unsigned char digest[HASH_LEN];
+    
+    sha256Init(&upload->ctx);
+    upload->offset = 0;
+    upload->prefixHash[0] = '\0';
+    
+    snprintf(upload->tempPath, BUFLEN, "%s%s/%s%s", BlobDir, BLOB_TMP_DIR, hash, BLOB_PART_EXT);
+    upload->fd = open(upload->tempPath, O_RDWR | O_CREAT, 0644);
+    if (upload->fd >= 0 && flock(upload->fd, LOCK_EX | LOCK_NB) < 0) {
+        close(upload->fd);
+        upload->fd = createBlobTemp(hash, upload->tempPath, BUFLEN);
+        return;
+    }
+    if (upload->fd < 0 || fstat(upload->fd, &st) < 0) {
+        perror("Unable to open partial upload");
+        return;
+    }
+    setCloseOnExec(upload->fd);
+    
+    if (st.st_size >= size) {
+        ftruncate(upload->fd, 0);
+        return;
+    }
+    
+    // Hash what's there so the client can check it's the start of the same file
+    unsigned char buffer[SYNC_CHUNK_LEN];
+    ssize_t n;
+    while ((n = read(upload->fd, buffer, SYNC_CHUNK_LEN)) > 0) {
+        sha256Update(&upload->ctx, buffer, n);
+        upload->offset += n;
+    }
+    
+    struct Sha256 prefix = upload->ctx;
+    sha256Final(&prefix, digest);
+    hashToHex(digest, upload->prefixHash);
+}
+
+// Receives a blob's content in DATA frames up to an END frame and stores it
+// if it hashes to hash. A resumed upload starts with an INFO frame "from offset",
+// 0 if the client couldn't use our partial copy. Returns the bytes received,
+// or -1 if it didn't match and the partial copy was dropped.
+long receiveBlob(int ClientSocket, const char *hash, struct BlobUpload *upload, int resumed) {
+    unsigned char *buffer = malloc(SYNC_CHUNK_LEN);
+    unsigned char digest[HASH_LEN];
+    char hex[HASH_HEX_LEN + 1];
+    long received = 0;
+    int type, len, failed = upload->fd < 0;
+    
+    if (resumed) {
+        char *end = NULL;
+        long from = -1;
+        len = receiveFrame(ClientSocket, &type, buffer, SYNC_CHUNK_LEN - 1);
+        if (len >= 0 && type == FRAME_INFO) {
+            buffer[len] = '\0';
+            if (strncmp((char *) buffer, "from ", strlen("from ")) == 0) {
+                from = strtol((char *) buffer + strlen("from "), &end, 10);
+            }
+        }
+        // Anything but exactly the partial copy we offered is taken as starting again
+        if (end == NULL || *end != '\0' || from < 0 || from != upload->offset) {
+            sha256Init(&upload->ctx);
+            upload->offset = 0;
+        }
+    } else {
+        upload->offset = 0;
+    }
+    if (upload->fd >= 0 && (ftruncate(upload->fd, upload->offset) < 0 || lseek(upload->fd, upload->offset, SEEK_SET) < 0)) {
+        failed = 1;
+    }
+    
+    // The data has to be read even if it can't be stored
+    while ((len = receiveFrame(ClientSocket, &type, buffer, SYNC_CHUNK_LEN)) >= 0 && type == FRAME_DATA) {
+        sha256Update(&upload->ctx, buffer, len);
+        if (upload->fd >= 0 && write(upload->fd, buffer, len) != len) {
+            failed = 1;
+        }
+        received += len;
+    }
+    free(buffer);
+    
+    sha256Final(&upload->ctx, digest);
+    hashToHex(digest, hex);
+    if (failed == 0 && strcmp(hex, hash) != 0) {
+        printf("blob %s doesn't match its content\n", hash);
+        failed = 1;
+    }
+    
+    // Into the store while the partial copy is still locked so that no one else picks it up
+    int blobLock = lockBlobs(LOCK_SH);
+    if (failed || storeBlob(upload->tempPath, hash) < 0) {
+        unlink(upload->tempPath);
+        received = -1;
+    }
+    unlockFile(blobLock);
+    if (upload->fd >= 0) {
+        close(upload->fd);
+    }
+    return received;
+}
+
+// Sets the hashes of dir's n newly uploaded files in its UPLOADS_FILE, keeping
+// the entries of its other files. Called under dir's build lock.
+void recordUploads(const char *dir, const char **names, const char **hashes, int n) {
+    char path[BUFLEN] = {0, }, tempPath[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%s", dir, UPLOADS_FILE);
+    snprintf(tempPath, BUFLEN, "%s.%d", path, getpid());
+    
+    FILE *out = fopen(tempPath, "w");
+    if (out == NULL) {
+        perror("Unable to record uploads");
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "%s %s\n", hashes[i], names[i]);
+    }
+    
+    FILE *in = fopen(path, "r");
+    char line[BUFLEN];
+    while (in != NULL && fgets(line, BUFLEN, in) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        const char *name = strchr(line, ' ');
+        int replaced = name == NULL;
+        
+        for (int i = 0; !replaced && i < n; i++) {
+            replaced = strcmp(name + 1, names[i]) == 0;
+        }
+        if (!replaced) {
+            fprintf(out, "%s\n", line);
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    
+    if (fclose(out) != 0 || rename(tempPath, path) < 0) {
+        perror("Unable to record uploads");
+        unlink(tempPath);
+    }
+}
+
+int compareHashes(const void *a, const void *b) {
+    return strcmp((const char *) a, (const char *) b);
+}
+
+// Reads the hashes every progname's UPLOADS_FILE lists into a sorted malloc'd
+// array. Returns how many, or -1 if they couldn't all be read.
+int listedBlobs(char (**hashes)[HASH_HEX_LEN + 1]) {
+    char root[BUFLEN] = {0, };
+    snprintf(root, BUFLEN, "%.*s", (int) (strlen(BlobDir) - strlen(BLOB_DIR "/")), BlobDir);
+    
+    int count = 0, size = 64;
+    *hashes = malloc(size * sizeof(**hashes));
+    DIR *d = opendir(root);
+    struct dirent *entry;
+    
+    while (*hashes != NULL && d != NULL && (entry = readdir(d)) != NULL) {
+        char path[BUFLEN] = {0, };
+        char line[BUFLEN];
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, BUFLEN, "%s%s/%s", root, entry->d_name, UPLOADS_FILE);
+        
+        FILE *fp = fopen(path, "r");
+        while (fp != NULL && fgets(line, BUFLEN, fp) != NULL) {
+            if (count == size) {
+                size *= 2;
+                char (*grown)[HASH_HEX_LEN + 1] = realloc(*hashes, size * sizeof(**hashes));
+                if (grown == NULL) {
+                    free(*hashes);
+                    *hashes = NULL;
+                    break;
+                }
+                *hashes = grown;
+            }
+            if (sscanf(line, "%64s", (*hashes)[count]) == 1) {
+                count++;
+            }
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    
+    if (d == NULL || *hashes == NULL) {
+        free(*hashes);
+        *hashes = NULL;
+        return -1;
+    }
+    qsort(*hashes, count, sizeof(**hashes), compareHashes);
+    return count;
+}
+
+// Deletes blobs no progname lists any more. Returns the number deleted.
+int collectBlobs(void) {
+    int lockFd = lockBlobs(LOCK_EX);
+    int collected = 0;
+    char (*listed)[HASH_HEX_LEN + 1] = NULL;
+    int noListed = listedBlobs(&listed);
+    
+    // Without every list a blob still in use could go
+    if (noListed < 0) {
+        unlockFile(lockFd);
+        return 0;
+    }
+    DIR *store = opendir(BlobDir);
+    struct dirent *entry;
+    
+    while (store != NULL && (entry = readdir(store)) != NULL) {
+        // Blobs are in two character directories named by their hash's first byte
+        if (strlen(entry->d_name) != 2 || entry->d_name[0] == '.') {
+            continue;
+        }
+        
+        char subdir[BUFLEN] = {0, };
+        snprintf(subdir, BUFLEN, "%s%s/", BlobDir, entry->d_name);
+        DIR *d = opendir(subdir);
+        struct dirent *blob;
+        
+        while (d != NULL && (blob = readdir(d)) != NULL) {
+            char path[BUFLEN] = {0, };
+            struct stat st;
+            snprintf(path, BUFLEN, "%s%s", subdir, blob->d_name);
+            
+            if (blob->d_name[0] != '.' && stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+                time(NULL) - st.st_mtime > BLOB_LINK_GRACE &&
+                bsearch(blob->d_name, listed, noListed, sizeof(*listed), compareHashes) == NULL) {
+                unlink(path);
+                collected++;
+            }
+        }
+        if (d != NULL) {
+            closedir(d);
+        }
+    }
+    if (store != NULL) {
+        closedir(store);
+    }
+    free(listed);
+    
+    unlockFile(lockFd);
+    return collected;
+}
+
+// Sets up the blob store in the server's directory and clears out what a
+// previous run left, blobs no progname lists and old partial uploads
+void blobStartup(void) {
+    char path[BUFLEN] = {0, };
+    
+    getcwd(BlobDir, sizeof(BlobDir) - sizeof(BLOB_DIR) - 1);
+    strcat(BlobDir, "/" BLOB_DIR "/");
+    mkdir(BlobDir, 0755);
+    snprintf(path, BUFLEN, "%s%s", BlobDir, BLOB_TMP_DIR);
+    mkdir(path, 0755);
+    
+    // Partial uploads are kept a while for their clients to resume
+    DIR *d = opendir(path);
+    struct dirent *entry;
+    while (d != NULL && (entry = readdir(d)) != NULL) {
+        char tempPath[BUFLEN] = {0, };
+        const char *ext = strrchr(entry->d_name, '.');
+        struct stat st;
+        snprintf(tempPath, BUFLEN, "%s/%s", path, entry->d_name);
+        
+        if (entry->d_name[0] == '.' || stat(tempPath, &st) < 0) {
+            continue;
+        }
+        if (ext == NULL || strcmp(ext, BLOB_PART_EXT) != 0 || time(NULL) - st.st_mtime > BLOB_PART_MAX_AGE) {
+            unlink(tempPath);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    
+    int collected = collectBlobs();
+    if (collected > 0) {
+        printf("Collected %d unused blobs\n", collected);
+    }
+}
+
+// Runs put (to get files from client) and handles errors.
+// The name a put or sync file is kept under in its progname. A relative path keeps
+// its directories so that projects can be laid out in them, anything else is only
+// the file's name, as is a path with a part that is empty or starts with a dot.
+void uploadName(const char *given, char *name, int len) {
+    const char *base = strrchr(given, '/');
+    int nested = base != NULL && given[0] != '/';
+    
+    for (const char *part = given; nested && part != NULL; part = strchr(part, '/')) {
+        if (*part == '/') {
+            part++;
+        }
+        if (*part == '.' || *part == '/' || *part == '\0') {
+            nested = 0;
+        }
+    }
+    snprintf(name, len, "%s", nested || base == NULL ? given : base + 1);
+}
+
+// Creates every missing directory above path
+void makeParentDirs(const char *path) {
+    char dir[BUFLEN];
+    snprintf(dir, BUFLEN, "%s", path);
+    
+    for (char *slash = strchr(dir + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
+    }
+}
+
+// Files are stored once in the blob store and copied into the progname
+// directory, the client only sending the ones the store doesn't have yet.
+int putCmd(int ClientSocket, char **commands, int noCommands) {
+    struct timespec start = {0};
+    struct Response resp;
+    clock_gettime(CLOCK_REALTIME, &start);
+    
+    // filesExpectedToRecieve - 1 for "put"
+    int filesExpectedToRecieve = noCommands - 1;
+    
+    int shouldOverride = 0;
+    if (strcmp(commands[noCommands - 1], "-f") == 0) {
+        shouldOverride = 1;
+        // -1 for "-f"
+        filesExpectedToRecieve -= 1;
+    }
+    
+    // Get the directory name
+    char dirName[40] = {0,};
+    if (noCommands >= 2) {
+        snprintf(dirName, sizeof(dirName), "%s", commands[1]);
+    }
+    
+    // -1 for the dirname in the command
+    filesExpectedToRecieve -= 1;
+    if (filesExpectedToRecieve < 0) {
+        filesExpectedToRecieve = 0;
+    }
+    
+    // The client follows the command with "size hash" for each file
+    char names[64][BUFLEN];
+    char hashes[64][HASH_HEX_LEN + 1];
+    long sizes[64];
+    for (int i = 0; i < filesExpectedToRecieve; i++) {
+        char manifest[BUFLEN] = {0, };
+        int type;
+        int len = receiveFrame(ClientSocket, &type, manifest, BUFLEN - 1);
+        manifest[len] = '\0';
+        if (type != FRAME_INFO || sscanf(manifest, "%ld %64s", &sizes[i], hashes[i]) != 2
+            || strlen(hashes[i]) != HASH_HEX_LEN || strspn(hashes[i], "0123456789abcdef") != HASH_HEX_LEN) {
+            printf("Malformed put manifest: %s\n", manifest);
+            close(ClientSocket);
+            exit(1);
+        }
+        
+        uploadName(commands[i + 2], names[i], BUFLEN);
+    }
+    
+    // Temporary response & handshake
+    char tempCommBuffer[BUFLEN] = {0, };
+    sprintf(tempCommBuffer, "ok. should get %d files and put them in %s, -f:%d\n", filesExpectedToRecieve, dirName, shouldOverride);
+    send_to_client(ClientSocket, tempCommBuffer);
+    
+    if (dirName[0] == '.' || strchr(dirName, '/') != NULL) {
+        send_to_client(ClientSocket, "progname can't start with . or contain /");
+        return OUTCOME_ERROR;
+    }
+    
+    // Build path for server
+    char path[BUFLEN] = "";
+    getcwd(path, sizeof(path));
+    strcat(path, "/");
+    strcat(path, dirName);
+    strcat(path, "/");
+    
+    struct stat st = {0};
+    
+    // If directory doesn't exist, create it with 755 perms
+    if (stat(dirName, &st) == -1) {
+        mkdir(dirName, 0755);
+    }
+    
+    // Count the number of files that can be recieved
+    int totalOK = 0;
+    
+    char errorString[BUFLEN] = {0, };
+    strcpy(errorString, "File/s ");
+    
+    for (int i = 0; i < filesExpectedToRecieve; i++) {
+        char newPath[BUFLEN] = {0, };
+        snprintf(newPath, BUFLEN, "%s%s", path, names[i]);
+        
+        // if not file totalOK += 1
+        if (names[i][0] == '.') {
+            strcat(errorString, names[i]);
+            strcat(errorString, " ");
+        } else if (access(newPath, F_OK) != 0 || shouldOverride == 1) {
+            totalOK += 1;
+        } else {
+            strcat(errorString, names[i]);
+            strcat(errorString, " ");
+        }
+    }
+    
+    printf("totalOK: %d, filesExpectedToRecieve: %d\n", totalOK, filesExpectedToRecieve);
+    
+    if (totalOK != filesExpectedToRecieve) {
+        strcat(errorString, "exist in ");
+        strcat(errorString, dirName);
+        strcat(errorString, " on server or are reserved. Use -f to override.");
+        send_to_client(ClientSocket, errorString);
+        return OUTCOME_ERROR;
+    }
+    
+    // "ok" then a line per file: "have" if the store has it already, "all" to
+    // send it, or "resume offset hash" if part of it came before a dropped connection
+    struct BlobUpload *uploads = calloc(filesExpectedToRecieve + 1, sizeof(struct BlobUpload));
+    int planned[64] = {0, };
+    
+    respInit(&resp, ClientSocket);
+    respInfo(&resp, "ok\n");
+    for (int i = 0; i < filesExpectedToRecieve; i++) {
+        if (hasBlob(hashes[i])) {
+            planned[i] = SYNC_HAVE;
+            respInfo(&resp, "have\n");
+            continue;
+        }
+        
+        openBlobUpload(hashes[i], sizes[i], &uploads[i]);
+        if (uploads[i].offset > 0) {
+            planned[i] = SYNC_RESUME;
+            respInfo(&resp, "resume %ld %s\n", uploads[i].offset, uploads[i].prefixHash);
+        } else {
+            planned[i] = SYNC_ALL;
+            respInfo(&resp, "all\n");
+        }
+    }
+    respEnd(&resp);
+    
+    int terminatedEarly = 0;
+    int alreadyStored = 0, resumed = 0;
+    long bytesReceived = 0, bytesTotal = 0;
+    
+    // The files are about to change under any build still going
+    cancelBackgroundBuild(path);
+    
+    // Recieve the missing blobs
+    for (int i = 0; i < filesExpectedToRecieve; i++) {
+        bytesTotal += sizes[i];
+        
+        if (planned[i] == SYNC_HAVE) {
+            alreadyStored++;
+        } else {
+            long received = receiveBlob(ClientSocket, hashes[i], &uploads[i], planned[i] == SYNC_RESUME);
+            if (received < 0) {
+                terminatedEarly = 1;
+                continue;
+            }
+            if (uploads[i].offset > 0) {
+                resumed++;
+            }
+            bytesReceived += received;
+        }
+    }
+    free(uploads);
+    
+    // Only once every file has arrived are they copied into progname, each under a
+    // temporary name first. The renames into place happen under the build lock, so
+    // a run builds from either the old files or the new ones, and if any file can't
+    // be copied the staged copies are dropped, leaving progname as it was.
+    // The store is only locked while copying so that collection doesn't wait for
+    // clients still sending.
+    char staged[64][BUFLEN];
+    int buildLock = terminatedEarly ? -1 : lockBuild(path);
+    int blobLock = terminatedEarly ? -1 : lockBlobs(LOCK_SH);
+    for (int i = 0; i < filesExpectedToRecieve; i++) {
+        char newPath[BUFLEN] = {0, };
+        snprintf(newPath, BUFLEN, "%s%s", path, names[i]);
+        staged[i][0] = '\0';
+        
+        if (terminatedEarly == 0) {
+            makeParentDirs(newPath);
+            if (stageBlob(hashes[i], newPath, staged[i], BUFLEN) < 0) {
+                terminatedEarly = 1;
+            }
+        }
+    }
+    unlockFile(blobLock);
+    
+    for (int i = 0; i < filesExpectedToRecieve; i++) {
+        char newPath[BUFLEN] = {0, };
+        snprintf(newPath, BUFLEN, "%s%s", path, names[i]);
+        
+        if (staged[i][0] == '\0') {
+            continue;
+        }
+        if (terminatedEarly) {
+            unlink(staged[i]);
+        } else {
+            printf("writing %s\n", newPath);
+            if (rename(staged[i], newPath) < 0) {
+                perror("Unable to move copied blob into place");
+                unlink(staged[i]);
+                terminatedEarly = 1;
+            }
+        }
+    }
+    if (terminatedEarly == 0) {
+        const char *uploadNames[64], *uploadHashes[64];
+        for (int i = 0; i < filesExpectedToRecieve; i++) {
+            uploadNames[i] = names[i];
+            uploadHashes[i] = hashes[i];
+        }
+        recordUploads(path, uploadNames, uploadHashes, filesExpectedToRecieve);
+    }
+    unlockFile(buildLock);
+    
+    // Error handling
+    respInit(&resp, ClientSocket);
+    if (terminatedEarly == 0) {
+        respInfo(&resp, "File/s sent successfully!\n%d of %d already on server, sent %ld of %ld bytes\n", alreadyStored, filesExpectedToRecieve, bytesReceived, bytesTotal);
+        if (resumed > 0) {
+            respInfo(&resp, "%d resumed from an earlier upload\n", resumed);
+        }
+        respCompressionStats(&resp);
+        respInfo(&resp, "\nTook: %lums", calcTDiff(start));
+    } else {
+        respInfo(&resp, "unable to write one or more of the files!");
+    }
+    respEnd(&resp);
+    
+    // Replaced files may have been the last use of their blobs
+    if (shouldOverride == 1) {
+        collectBlobs();
+    }
+    
+    // Compile now while the client gets round to asking for a run
+    if (terminatedEarly == 0) {
+        startBackgroundBuild(path);
+    }
+    
+    return terminatedEarly ? OUTCOME_ERROR : OUTCOME_OK;
+
+}
+
+// blob hash size, stores one file's content ahead of the put that copies it.
+// Clients send a put's files over several connections at once with this.
+int blobCmd(int ClientSocket, char **commands, int k) {
+    struct Response resp;
+    struct BlobUpload upload;
+    
+    if (k != 3 || strlen(commands[1]) != HASH_HEX_LEN || strspn(commands[1], "0123456789abcdef") != HASH_HEX_LEN) {
+        send_to_client(ClientSocket, "blob usage: \"blob hash size\"\n");
+        return OUTCOME_ERROR;
+    }
+    
+    // The plan is "have", "all" or "resume offset hash" as for put
+    respInit(&resp, ClientSocket);
+    if (hasBlob(commands[1])) {
+        respInfo(&resp, "have\n");
+        respEnd(&resp);
+        return OUTCOME_OK;
+    }
+    
+    openBlobUpload(commands[1], atol(commands[2]), &upload);
+    if (upload.offset > 0) {
+        respInfo(&resp, "resume %ld %s\n", upload.offset, upload.prefixHash);
+    } else {
+        respInfo(&resp, "all\n");
+    }
+    respEnd(&resp);
+    
+    long received = receiveBlob(ClientSocket, commands[1], &upload, upload.offset > 0);
+    
+    respInit(&resp, ClientSocket);
+    if (received < 0) {
+        respInfo(&resp, "failed\n");
+    } else {
+        respInfo(&resp, "stored %ld\n", received);
+    }
+    respEnd(&resp);
+    return received < 0 ? OUTCOME_ERROR : OUTCOME_OK;
+}
+
+// A file named in a sync, what the client says it holds and what it has to send
+struct SyncFile {
+    char name[BUFLEN];
+    long size;
+    long blockLen;
+    int noBlocks;
+    char hash[HASH_HEX_LEN + 1];
+    // noBlocks signatures, SYNC_SIG_LEN bytes each
+    unsigned char *sigs;
+    // Where each block was found in our copy, -1 if the client has to send it
+    long *matches;
+    int plan;
+};
+
+// A block's weak checksum, for sorting blocks so they can be looked up by it
+struct WeakIndex {
+    uint32_t weak;
+    int block;
+};
+
+int compareWeak(const void *a, const void *b) {
+    uint32_t x = ((const struct WeakIndex *) a)->weak;
+    uint32_t y = ((const struct WeakIndex *) b)->weak;
+    return x < y ? -1 : x > y;
+}
+
+uint32_t sigWeak(const unsigned char *sig) {
+    uint32_t weak;
+    memcpy(&weak, sig, 4);
+    return ntohl(weak);
+}
+
+// 1 if len bytes of data have the strong checksum in sig
+int sigStrongMatches(const unsigned char *sig, const unsigned char *data, long len) {
+    unsigned char digest[HASH_LEN];
+    sha256(data, len, digest);
+    return memcmp(sig + 4, digest, SYNC_STRONG_LEN) == 0;
+}
+
+// Looks for each of the client's blocks in old at every byte offset with the
+// rolling checksum, so edits that shift the rest of a file still match.
+// Returns how many blocks were found.
+int matchBlocks(struct SyncFile *file, const unsigned char *old, long oldSize) {
+    long L = file->blockLen;
+    int fullBlocks = (int) (file->size / L);
+    int found = 0;
+    
+    for (int i = 0; i < file->noBlocks; i++) {
+        file->matches[i] = -1;
+    }
+    
+    if (fullBlocks > 0 && oldSize >= L) {
+        struct WeakIndex *index = malloc(fullBlocks * sizeof(struct WeakIndex));
+        for (int i = 0; i < fullBlocks; i++) {
+            index[i].weak = sigWeak(file->sigs + i * SYNC_SIG_LEN);
+            index[i].block = i;
+        }
+        qsort(index, fullBlocks, sizeof(struct WeakIndex), compareWeak);
+        
+        uint32_t a = 0, b = 0;
+        for (long i = 0; i < L; i++) {
+            a += old[i];
+            b += (uint32_t) (L - i) * old[i];
+        }
+        
+        for (long offset = 0; ; offset++) {
+            struct WeakIndex key = {(a & 0xffff) | (b << 16), 0};
+            struct WeakIndex *hit = bsearch(&key, index, fullBlocks, sizeof(struct WeakIndex), compareWeak);
+            
+            if (hit != NULL) {
+                // bsearch lands anywhere in a run of equal checksums
+                while (hit > index && hit[-1].weak == key.weak) {
+                    hit--;
+                }
+                for (; hit < index + fullBlocks && hit->weak == key.weak; hit++) {
+                    if (file->matches[hit->block] < 0 && sigStrongMatches(file->sigs + hit->block * SYNC_SIG_LEN, old + offset, L)) {
+                        file->matches[hit->block] = offset;
+                        found++;
+                    }
+                }
+            }
+            
+            if (offset + L >= oldSize) {
+                break;
+            }
+            a = a - old[offset] + old[offset + L];
+            b = b - (uint32_t) L * old[offset] + a;
+        }
+        
+        free(index);
+    }
+    
+    // A short last block is only looked for where it was and at the end
+    long tailLen = file->size - fullBlocks * L;
+    if (tailLen > 0) {
+        int tail = file->noBlocks - 1;
+        long candidates[2] = {fullBlocks * L, oldSize - tailLen};
+        
+        for (int i = 0; i < 2 && file->matches[tail] < 0; i++) {
+            long offset = candidates[i];
+            if (offset >= 0 && offset + tailLen <= oldSize
+                && weakChecksum(old + offset, tailLen) == sigWeak(file->sigs + tail * SYNC_SIG_LEN)
+                && sigStrongMatches(file->sigs + tail * SYNC_SIG_LEN, old + offset, tailLen)) {
+                file->matches[tail] = offset;
+                found++;
+            }
+        }
+    }
+    
+    return found;
+}
+
+// Receives a file's manifest: "size blockLen noBlocks hash" then the block signatures
+void receiveManifest(int ClientSocket, struct SyncFile *file) {
+    char header[BUFLEN] = {0, };
+    int type;
+    
+    int len = receiveFrame(ClientSocket, &type, header, BUFLEN - 1);
+    header[len] = '\0';
+    
+    if (type != FRAME_INFO || sscanf(header, "%ld %ld %d %64s", &file->size, &file->blockLen, &file->noBlocks, file->hash) != 4
+        || strlen(file->hash) != HASH_HEX_LEN || strspn(file->hash, "0123456789abcdef") != HASH_HEX_LEN
+        || file->size < 0 || file->noBlocks < 0 || file->noBlocks > SYNC_MAX_BLOCKS
+        || (file->noBlocks > 0 && (file->blockLen < SYNC_BLOCK_MIN || (file->size + file->blockLen - 1) / file->blockLen != file->noBlocks))) {
+        printf("Malformed sync manifest: %s\n", header);
+        close(ClientSocket);
+        exit(1);
+    }
+    
+    file->sigs = malloc(file->noBlocks * SYNC_SIG_LEN + 1);
+    file->matches = malloc((file->noBlocks + 1) * sizeof(long));
+    if (file->noBlocks > 0 && receiveFrame(ClientSocket, &type, file->sigs, file->noBlocks * SYNC_SIG_LEN) != file->noBlocks * SYNC_SIG_LEN) {
+        printf("Sync block signatures missing\n");
+        close(ClientSocket);
+        exit(1);
+    }
+}
+
+// Works out what the client has to send of file, comparing it with our copy at path
+void planSync(struct SyncFile *file, const char *path, struct Response *resp) {
+    long oldSize = 0;
+    unsigned char *old = readWholeFile(path, &oldSize);
+    unsigned char digest[HASH_LEN];
+    char hex[HASH_HEX_LEN + 1];
+    
+    file->plan = SYNC_ALL;
+    
+    if (old != NULL && oldSize == file->size) {
+        sha256(old, oldSize, digest);
+        hashToHex(digest, hex);
+        if (strcmp(hex, file->hash) == 0) {
+            file->plan = SYNC_SAME;
+        }
+    }
+    if (file->plan == SYNC_ALL && hasBlob(file->hash)) {
+        // Uploaded before, maybe under another progname
+        file->plan = SYNC_HAVE;
+    }
+    if (old != NULL && file->plan == SYNC_ALL && file->noBlocks > 0 && matchBlocks(file, old, oldSize) > 0) {
+        file->plan = SYNC_BLOCKS;
+    }
+    free(old);
+    
+    if (file->plan == SYNC_SAME) {
+        respInfo(resp, "same\n");
+    } else if (file->plan == SYNC_HAVE) {
+        respInfo(resp, "have\n");
+    } else if (file->plan == SYNC_ALL) {
+        respInfo(resp, "all\n");
+    } else {
+        // One hex digit per four blocks, bit i set if block 4n + i is needed
+        char bitmap[SYNC_MAX_BLOCKS / 4 + 1] = {0, };
+        for (int i = 0; i < (file->noBlocks + 3) / 4; i++) {
+            int nibble = 0;
+            for (int j = 0; j < 4 && 4 * i + j < file->noBlocks; j++) {
+                if (file->matches[4 * i + j] < 0) {
+                    nibble |= 1 << j;
+                }
+            }
+            bitmap[i] = "0123456789abcdef"[nibble];
+        }
+        respInfo(resp, "need %s\n", bitmap);
+    }
+}
+
+// Receives the parts of file the client sends, stores the new version as a blob
+// and copies it to path. Returns the bytes received, or -1 if the result
+// couldn't be written or didn't match the client's hash, leaving path as it was.
+long applySync(int ClientSocket, struct SyncFile *file, const char *path) {
+    char tempPath[BUFLEN] = {0, };
+    long oldSize = 0, received = 0;
+    unsigned char *old = file->plan == SYNC_BLOCKS ? readWholeFile(path, &oldSize) : NULL;
+    unsigned char *buffer = malloc(SYNC_CHUNK_LEN > file->blockLen ? SYNC_CHUNK_LEN : file->blockLen);
+    unsigned char digest[HASH_LEN];
+    char hex[HASH_HEX_LEN + 1];
+    struct Sha256 ctx;
+    int failed = 0, type, len;
+    
+    sha256Init(&ctx);
+    int fd = createBlobTemp(file->hash, tempPath, BUFLEN);
+    if (fd < 0) {
+        failed = 1;
+    }
+    
+    if (file->plan == SYNC_ALL) {
+        while ((len = receiveFrame(ClientSocket, &type, buffer, SYNC_CHUNK_LEN)) >= 0 && type == FRAME_DATA) {
+            sha256Update(&ctx, buffer, len);
+            if (fd >= 0 && write(fd, buffer, len) != len) {
+                failed = 1;
+            }
+            received += len;
+        }
+    } else {
+        for (int i = 0; i < file->noBlocks; i++) {
+            long blockLen = i < file->noBlocks - 1 ? file->blockLen : file->size - i * file->blockLen;
+            const unsigned char *data = buffer;
+            
+            if (file->matches[i] >= 0 && old != NULL && file->matches[i] + blockLen <= oldSize) {
+                data = old + file->matches[i];
+            } else {
+                len = receiveFrame(ClientSocket, &type, buffer, file->blockLen);
+                received += len;
+                if (type != FRAME_DATA || len != blockLen) {
+                    failed = 1;
+                    continue;
+                }
+            }
+            
+            sha256Update(&ctx, data, blockLen);
+            if (fd >= 0 && write(fd, data, blockLen) != blockLen) {
+                failed = 1;
+            }
+        }
+        
+        // The client ends every file with an END frame
+        receiveFrame(ClientSocket, &type, buffer, file->blockLen);
+    }
+    
+    free(old);
+    free(buffer);
+    if (fd >= 0) {
+        close(fd);
+    }
+    
+    sha256Final(&ctx, digest);
+    hashToHex(digest, hex);
+    if (failed == 0 && strcmp(hex, file->hash) != 0) {
+        printf("sync of %s doesn't match the client's hash\n", file->name);
+        failed = 1;
+    }
+    int blobLock = lockBlobs(LOCK_SH);
+    if (failed || storeBlob(tempPath, file->hash) < 0 || placeBlob(file->hash, path) < 0) {
+        unlink(tempPath);
+        received = -1;
+    }
+    unlockFile(blobLock);
+    return received;
+}
+
+// Runs sync, an upload that only transfers what changed since the last put or sync.
+// The client sends each file's hash and block signatures, we reply with what
+// we're missing and rebuild changed files from our copy and the blocks it sends.
+// Files that haven't changed are left alone, keeping their mtime so run doesn't rebuild.
+int syncCmd(int ClientSocket, char **commands, int noCommands) {
+    struct timespec start = {0};
+    struct Response resp;
+    clock_gettime(CLOCK_REALTIME, &start);
+    
+    int noFiles = noCommands - 2;
+    if (noFiles < 0) {
+        noFiles = 0;
+    }
+    struct SyncFile *files = calloc(noFiles + 1, sizeof(struct SyncFile));
+    
+    // The manifests follow the command whether or not we can use them
+    for (int i = 0; i < noFiles; i++) {
+        uploadName(commands[i + 2], files[i].name, BUFLEN);
+        receiveManifest(ClientSocket, &files[i]);
+    }
+    
+    respInit(&resp, ClientSocket);
+    
+    if (noFiles == 0 || strchr(commands[1], '/') != NULL || commands[1][0] == '.') {
+        respInfo(&resp, "sync usage: \"sync progname sourcefile[s]\"\n");
+        respEnd(&resp);
+        free(files);
+        return OUTCOME_ERROR;
+    }
+    for (int i = 0; i < noFiles; i++) {
+        if (files[i].name[0] == '.' || files[i].name[0] == '\0') {
+            respInfo(&resp, "Can't sync %s, names starting with . are kept for the server\n", files[i].name);
+            respEnd(&resp);
+            free(files);
+            return OUTCOME_ERROR;
+        }
+    }
+    
+    char dir[BUFLEN] = {0, };
+    getcwd(dir, sizeof(dir));
+    strcat(dir, "/");
+    strcat(dir, commands[1]);
+    strcat(dir, "/");
+    
+    struct stat st = {0};
+    if (stat(commands[1], &st) == -1) {
+        mkdir(commands[1], 0755);
+    }
+    
+    // What each file needs, one line per file after "ok"
+    respInfo(&resp, "ok\n");
+    for (int i = 0; i < noFiles; i++) {
+        char path[BUFLEN] = {0, };
+        snprintf(path, BUFLEN, "%s%s", dir, files[i].name);
+        planSync(&files[i], path, &resp);
+    }
+    respEnd(&resp);
+    
+    // Receive and write the changed files
+    long sent = 0, total = 0;
+    int changed = 0, unchanged = 0, failed = 0;
+    const char **changedNames = calloc(noFiles + 1, sizeof(char *));
+    const char **changedHashes = calloc(noFiles + 1, sizeof(char *));
+    
+    respInit(&resp, ClientSocket);
+    for (int i = 0; i < noFiles; i++) {
+        char path[BUFLEN] = {0, };
+        snprintf(path, BUFLEN, "%s%s", dir, files[i].name);
+        total += files[i].size;
+        
+        if (files[i].plan == SYNC_SAME) {
+            respInfo(&resp, "%s: unchanged\n", files[i].name);
+            unchanged++;
+            continue;
+        }
+        
+        if (changed == 0) {
+            // The files are about to change under any build still going
+            cancelBackgroundBuild(dir);
+        }
+        
+        makeParentDirs(path);
+        long received;
+        if (files[i].plan == SYNC_HAVE) {
+            int blobLock = lockBlobs(LOCK_SH);
+            received = placeBlob(files[i].hash, path);
+            unlockFile(blobLock);
+        } else {
+            received = applySync(ClientSocket, &files[i], path);
+        }
+        if (received < 0) {
+            respInfo(&resp, "%s: unable to write, left as it was\n", files[i].name);
+            failed++;
+            continue;
+        }
+        
+        sent += received;
+        changedNames[changed] = files[i].name;
+        changedHashes[changed] = files[i].hash;
+        changed++;
+        if (files[i].plan == SYNC_HAVE) {
+            respInfo(&resp, "%s: already on server\n", files[i].name);
+        } else if (files[i].plan == SYNC_ALL) {
+            respInfo(&resp, "%s: sent in full (%ld bytes)\n", files[i].name, received);
+        } else {
+            respInfo(&resp, "%s: sent %ld of %ld bytes\n", files[i].name, received, files[i].size);
+        }
+    }
+    
+    if (changed > 0) {
+        int buildLock = lockBuild(dir);
+        recordUploads(dir, changedNames, changedHashes, changed);
+        unlockFile(buildLock);
+    }
+    free(changedNames);
+    free(changedHashes);
+    
+    respInfo(&resp, "\n%d changed, %d unchanged", changed, unchanged);
+    if (failed > 0) {
+        respInfo(&resp, ", %d failed", failed);
+    }
+    respInfo(&resp, "\nSent %ld of %ld bytes (%.1f%% saved)\n", sent, total, total > 0 ? 100.0 * (total - sent) / total : 0.0);
+    respCompressionStats(&resp);
+    respInfo(&resp, "\nTook: %lums", calcTDiff(start));
+    respEnd(&resp);
+    
+    for (int i = 0; i < noFiles; i++) {
+        free(files[i].sigs);
+        free(files[i].matches);
+    }
+    free(files);
+    
+    if (changed > 0) {
+        // Replaced files may have been the last use of their blobs
+        collectBlobs();
+        
+        // Compile now while the client gets round to asking for a run
+        startBackgroundBuild(dir);
+    }
+    return failed > 0 ? OUTCOME_ERROR : OUTCOME_OK;
+}
+
+// Runs hello, which the client sends on connecting with the codecs it has.
+// Picks the best one we have too for the rest of the connection.
+void helloCmd(int ClientSocket, char **commands, int k) {
+    char reply[BUFLEN] = {0, };
+    int picked = CODEC_NONE;
+    
+    for (int codec = NO_CODECS - 1; codec > CODEC_NONE && picked == CODEC_NONE; codec--) {
+#ifndef HAVE_ZLIB
+        if (codec == CODEC_ZLIB) {
+            continue;
+        }
+#endif
+        for (int i = 1; i < k; i++) {
+            if (strcmp(commands[i], codecNames[codec]) == 0) {
+                picked = codec;
+            }
+        }
+    }
+    
+    // The reply itself goes uncompressed
+    Codec = CODEC_NONE;
+    printf("Client picked codec %s\n", codecNames[picked]);
+    snprintf(reply, BUFLEN, "codec %s", codecNames[picked]);
+    send_to_client(ClientSocket, reply);
+    Codec = picked;
+}
+
+// Runs the sys command using popen and returns the result
+void sysCmd(int ClientSocket) {
+    FILE *sys;
+    struct timespec start;
+    struct Response resp;
+    clock_gettime(CLOCK_REALTIME, &start);
+    respInit(&resp, ClientSocket);
+    
+#ifdef __APPLE__
+    
+    sys = popen("sw_vers", "r");
+    
+    // Get the operating system information
+    respAppendFd(&resp, FRAME_DATA, fileno(sys));
+    pclose(sys);
+    
+    // Read popen
+    char buffer[BUFLEN];
+    size_t size = sizeof(buffer);
+    if (sysctlbyname("machdep.cpu.brand_string", &buffer, &size, NULL, 0) < 0) {
+        perror("sysctl");
+    } else {
+        respAppend(&resp, "\n", 1);
+        respAppend(&resp, buffer, strlen(buffer));
+    }
+    
+#endif
+    
+#ifdef __linux__
+    // Linux code
+    sys = popen("lshw -class processor 2>&1", "r");
+    respAppendFd(&resp, FRAME_DATA, fileno(sys));
+    pclose(sys);
+#endif
+    
+    // Send response
+    respInfo(&resp, "\n\nTook: %lums", calcTDiff(start));
+    respEnd(&resp);
+    
+    return;
+}
+
+// Reports connections and reply buffers across the whole server
+void statsCmd(int ClientSocket) {
+    struct Response resp;
+    char buffer[BUFLEN * 2];
+    respInit(&resp, ClientSocket);
+    
+    int len = snprintf(buffer, sizeof(buffer),
+                       "Connections: %ld open, %ld since start\n"
+                       "Reply buffers: %ld bytes buffered, peak %ld, budget %ld per connection and %ld in total\n"
+                       "Budget flushes: %ld\n"
+                       "Stalled clients: %ld now, %ld stalls totalling %ldms, %ld evicted (policy %s after %ds)\n",
+                       statLoad(&Stats->connections), statLoad(&Stats->totalConnections),
+                       statLoad(&Stats->buffered), statLoad(&Stats->peakBuffered), Config.connBudget, Config.globalBudget,
+                       statLoad(&Stats->budgetFlushes),
+                       statLoad(&Stats->stalled), statLoad(&Stats->stalls), statLoad(&Stats->stallMs),
+                       statLoad(&Stats->evictions), evictNames[Config.evictPolicy], Config.stallTimeout);
+    respAppend(&resp, buffer, len);
+    respEnd(&resp);
+}
+
+// trace [rate] shows or sets the fraction of requests traced, from 0 for none to 1 for all
+void traceCmd(int ClientSocket, char **commands, int k) {
+    struct Response resp;
+    respInit(&resp, ClientSocket);
+    
+    if (TraceFd < 0) {
+        respInfo(&resp, "Tracing is off, start the server with -t file to trace requests\n");
+        respEnd(&resp);
+        return;
+    }
+    
+    if (k >= 2) {
+        char *end;
+        double rate = strcmp(commands[1], "off") == 0 ? 0 : strtod(commands[1], &end);
+        
+        if (strcmp(commands[1], "off") != 0 && (end == commands[1] || rate < 0 || rate > 1)) {
+            respInfo(&resp, "trace usage: \"trace [rate|off]\" with rate from 0 to 1\n");
+            respEnd(&resp);
+            return;
+        }
+        __atomic_store_n(&Stats->traceRate, (long) (rate * TRACE_RATE_SCALE), __ATOMIC_RELAXED);
+    }
+    
+    respInfo(&resp, "Tracing %.4g%% of requests to %s\n", statLoad(&Stats->traceRate) * 100.0 / TRACE_RATE_SCALE, Config.tracePath);
+    respEnd(&resp);
+}
+
+// Returns 1 = file, 0 = dir
+int isFileOrDir(const char *path) {
+    struct stat path_stat;
+    stat(path, &path_stat);
+    return S_ISREG(path_stat.st_mode);
+}
+
+// Identifies a version of a file: inode, size and mtime. Files are only ever
+// replaced by renaming a new one over them, so any change gives a new inode.
+void fileValidator(struct stat *st, char *validator, int len) {
+#ifdef __APPLE__
+    unsigned long nsec = (unsigned long) st->st_mtimespec.tv_nsec;
+#else
+    unsigned long nsec = (unsigned long) st->st_mtim.tv_nsec;
+#endif
+    snprintf(validator, len, "%llx-%llx-%llx.%lx", (unsigned long long) st->st_ino, (unsigned long long) st->st_size,
+             (unsigned long long) st->st_mtime, nsec);
+}
+
+// 1 if the first len bytes of fd hash to hash
+int prefixMatches(int fd, long len, const char *hash) {
+    unsigned char buffer[SYNC_CHUNK_LEN];
+    unsigned char digest[HASH_LEN];
+    char hex[HASH_HEX_LEN + 1];
+    struct Sha256 ctx;
+    long offset = 0;
+    
+    sha256Init(&ctx);
+    while (offset < len) {
+        ssize_t n = pread(fd, buffer, len - offset < SYNC_CHUNK_LEN ? len - offset : SYNC_CHUNK_LEN, offset);
+        if (n <= 0) {
+            return 0;
+        }
+        sha256Update(&ctx, buffer, n);
+        offset += n;
+    }
+    sha256Final(&ctx, digest);
+    hashToHex(digest, hex);
+    return strcmp(hex, hash) == 0;
+}
+
+// Runs get command and handles errors.
+// A validator from the client's cache after the filename skips sending an unchanged file.
+// The client may follow it with the validator, length and hash of a copy it didn't
+// get all of, in which case the rest of the same version is sent after a RESUME frame.
+void getCmd(int ClientSocket, char **commands, int k) {
+    
+    struct timespec start;
+    struct Response resp;
+    clock_gettime(CLOCK_REALTIME, &start);
+    
+    if (k != 3 && k != 4 && k != 7) {
+        send_to_client(ClientSocket, "get usage: \"get progname sourcefile\"\n");
+        return;
+    }
+    
+    char path[BUFLEN] = "";
+    
+    getcwd(path, sizeof(path));
+    strcat(path, "/");
+    strcat(path, commands[1]);
+    strcat(path, "/");
+    strcat(path, commands[2]);
+    
+    if (access(path, F_OK) != -1) {
+        if (isFileOrDir(path) == 1) {
+            //printf("file exists\n");
+        } else {
+            // do not send directories
+            send_to_client(ClientSocket, "Can't send directories\n");
+            return;
+        }
+    } else {
+        //do not send anything to server if any of the files do not exist
+        send_to_client(ClientSocket, "File does not exist\n");
+        return;
+    }
+    
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        send_to_client(ClientSocket, strerror(errno));
+        return;
+    }
+    
+    char validator[128] = {0, };
+    fileValidator(&st, validator, sizeof(validator));
+    
+    respInit(&resp, ClientSocket);
+    
+    if (k >= 4 && strcmp(commands[3], validator) == 0) {
+        // The client's cached copy is current
+        close(fd);
+        respMarker(&resp, FRAME_NOT_MODIFIED);
+        respInfo(&resp, "\n\nNot modified, %lld bytes not sent\nTook: %lums\n", (long long) st.st_size, calcTDiff(start));
+        respEnd(&resp);
+        return;
+    }
+    
+    respAppendType(&resp, FRAME_VALIDATOR, validator, strlen(validator));
+    
+    long resumeAt = 0;
+    if (k == 7 && strcmp(commands[4], validator) == 0) {
+        long offset = atol(commands[5]);
+        if (offset > 0 && offset <= st.st_size && prefixMatches(fd, offset, commands[6])) {
+            char text[32];
+            resumeAt = offset;
+            respAppendType(&resp, FRAME_RESUME, text, snprintf(text, sizeof(text), "%ld", resumeAt));
+            lseek(fd, resumeAt, SEEK_SET);
+        }
+    }
+    
+    if (isLocalClient(ClientSocket)) {
+        // Local clients read the file themselves through a read only descriptor
+        respSendFd(&resp, fd);
+    } else {
+        // Send, however big the file is
+        respAppendFd(&resp, FRAME_DATA, fd);
+    }
+    close(fd);
+    
+    // Make and send response
+    respInfo(&resp, "\n\n");
+    if (resumeAt > 0) {
+        respInfo(&resp, "Resumed after %ld of %lld bytes\n", resumeAt, (long long) st.st_size);
+    }
+    respCompressionStats(&resp);
+    respInfo(&resp, "Took: %lums\n", calcTDiff(start));
+    respEnd(&resp);
+    
+    return;
+}
+
+// Runs list cmd
+void listCmd(int ClientSocket, char **commands, int noCommands) {
+    FILE *sys;
     struct timespec start;
-    char responseTime[64];
     clock_gettime(CLOCK_REALTIME, &start);
     
-    char *fileContentsBuffer = malloc(FILEBUFLEN);
+    // Builds ls command to run with popen
+    char cmd[40] = "ls ";
+    
+    if (noCommands == 1) {
+        strcat(cmd, ". ");
+    } else if (noCommands == 2) {
+        if (strcmp(commands[1], "-l") == 0) {
+            strcat(cmd, "-l ");
+        }
+        strcat(cmd, commands[1]);
+    } else if (noCommands == 3) {
+        if (strcmp(commands[1], "-l") == 0) {
+            strcat(cmd, "-l ");
+        }
+        strcat(cmd, commands[2]);
+    } else {
+        strcat(cmd, commands[1]);
+    }
+    
+    // to redirect stderr too
+    strcat(cmd, " 2>&1");
+    sys = popen(cmd, "r");
+    
+    // Read popen
+    struct Response resp;
+    respInit(&resp, ClientSocket);
+    respAppendFd(&resp, FRAME_DATA, fileno(sys));
+    pclose(sys);
+    
+    // Make and send response
+    respInfo(&resp, "\n\nTook: %lums\n", calcTDiff(start));
+    respEnd(&resp);
+    
+    return;
+    
+}
+
+// splits input and updates k
+// input "in p ut" -> ["in", "p", "ut"]; k = 3
+char** separateCommands(char * input, int* nk) {
+    char *inputCopy = input;
+    char delim[5] = " \n\0";
+    printf("input %s\n", input);
+    static char *commands[64] = {0, };
+
+    int k = 0;
+    
+    commands[k] = strtok(inputCopy, delim);
+    
+    while( commands[k] != NULL ) {
+        k++;
+        commands[k] = strtok(NULL, delim);
+    }
+    
+    printf("Commands: [");
+    for (int i = 0; i < k; i++) {
+        if (i == (k-1)) {
+            printf("%s", commands[i]);
+        } else {
+            printf("%s, ", commands[i]);
+        }
+    }
+    printf("]\n");
+    
+    // Assign k, basicially returning 2 params but not
+    *nk = k;
+    return commands;
+}
+
+// Build profiles selectable per progname with the profile command.
+// "default" is the original plain gcc build and is the baseline for speedups.
+struct BuildProfile {
+    const char *name;
+    const char *flags;
+};
+
+static const struct BuildProfile buildProfiles[] = {
+    {"default", ""},
+    {"debug", "-O0 -g"},
+    {"O2", "-O2"},
+    {"native", "-O3 -march=native"},
+    {"lto", "-O3 -march=native -flto"},
+    {"pgo", "-O3 -march=native"},
+};
+
+#define NO_BUILD_PROFILES (int) (sizeof(buildProfiles) / sizeof(buildProfiles[0]))
+
+// Looks up a build profile by name, NULL if there is no such profile
+const struct BuildProfile *findProfile(const char *name) {
+    for (int i = 0; i < NO_BUILD_PROFILES; i++) {
+        if (strcmp(buildProfiles[i].name, name) == 0) {
+            return &buildProfiles[i];
+        }
+    }
+    return NULL;
+}
+
+// Reads the first word of dir/fileName into value, returns 0 if the file couldn't be read
+int readDirFile(const char *dir, const char *fileName, char *value, int len) {
+    char path[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%s", dir, fileName);
+    
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    
+    int ok = fgets(value, len, fp) != NULL;
+    fclose(fp);
+    value[strcspn(value, " \n")] = '\0';
+    return ok;
+}
+
+// Replaces the contents of dir/fileName with value
+void writeDirFile(const char *dir, const char *fileName, const char *value) {
+    char path[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%s", dir, fileName);
+    
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror("Unable to write build state");
+        return;
+    }
+    fprintf(fp, "%s\n", value);
+    fclose(fp);
+}
+
+// The active build profile of the progname in dir, "default" if none was chosen
+const struct BuildProfile *activeProfile(const char *dir) {
+    char name[64] = {0, };
+    const struct BuildProfile *profile = NULL;
+    
+    if (readDirFile(dir, BUILD_PROFILE_FILE, name, sizeof(name))) {
+        profile = findProfile(name);
+    }
+    if (profile == NULL) {
+        profile = &buildProfiles[0];
+    }
+    return profile;
+}
+
+// 1 if name is a source or build file that a change to means run has to build again
+int isSourceFile(const char *name) {
+    static const char *extensions[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp", ".hxx", ".cmake", ".mk", ".in"};
+    const char *ext = strrchr(name, '.');
+    
+    if (strcmp(name, "Makefile") == 0 || strcmp(name, "makefile") == 0 || strcmp(name, "GNUmakefile") == 0 ||
+        strcmp(name, "CMakeLists.txt") == 0 || strcmp(name, BUILD_MANIFEST_FILE) == 0) {
+        return 1;
+    }
+    for (int i = 0; ext != NULL && i < (int) (sizeof(extensions) / sizeof(extensions[0])); i++) {
+        if (strcmp(ext, extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// How the progname in dir is built, PROJECT_GCC if it's just C files
+int projectKind(const char *dir) {
+    static const char *makefiles[] = {"GNUmakefile", "makefile", "Makefile"};
+    char path[BUFLEN] = {0, };
+    
+    snprintf(path, BUFLEN, "%s%s", dir, BUILD_MANIFEST_FILE);
+    if (access(path, F_OK) == 0) {
+        return PROJECT_MANIFEST;
+    }
+    snprintf(path, BUFLEN, "%sCMakeLists.txt", dir);
+    if (access(path, F_OK) == 0) {
+        return PROJECT_CMAKE;
+    }
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, BUFLEN, "%s%s", dir, makefiles[i]);
+        if (access(path, F_OK) == 0) {
+            return PROJECT_MAKE;
+        }
+    }
+    return PROJECT_GCC;
+}
+
+// FNV-1a over len bytes, continuing from hash
+uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Fingerprints a file's path, identity, size and mtime
+uint64_t fingerprintFile(const char *path, const struct stat *st) {
+    uint64_t hash = 14695981039346656037ULL;
+    hash = fnv1a(hash, path, strlen(path));
+    hash = fnv1a(hash, &st->st_ino, sizeof(st->st_ino));
+    hash = fnv1a(hash, &st->st_size, sizeof(st->st_size));
+    hash = fnv1a(hash, &st->st_mtime, sizeof(st->st_mtime));
+    return hash;
+}
+
+// Fingerprints every source under dir, down to depth more directories.
+// Order independent so that readdir order doesn't matter.
+// Names starting with . are server state or builds and are skipped.
+uint64_t fingerprintSources(const char *dir, int depth) {
+    uint64_t fingerprint = 0;
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    
+    if (d == NULL) {
+        return 0;
+    }
+    
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        
+        char path[BUFLEN] = {0, };
+        struct stat st;
+        snprintf(path, BUFLEN, "%s%s", dir, entry->d_name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (depth > 0) {
+                strncat(path, "/", BUFLEN - strlen(path) - 1);
+                fingerprint += fingerprintSources(path, depth - 1);
+            }
+            continue;
+        }
+        if (isSourceFile(entry->d_name) == 0) {
+            continue;
+        }
+        
+        fingerprint += fingerprintFile(path, &st);
+    }
+    
+    closedir(d);
+    return fingerprint;
+}
+
+// Fingerprints the files put and sync recorded in dir's UPLOADS_FILE, which
+// unlike what a build generates are only changed by another upload
+uint64_t uploadedFingerprint(const char *dir) {
+    uint64_t fingerprint = 0;
+    char path[BUFLEN] = {0, };
+    char line[BUFLEN];
+    snprintf(path, BUFLEN, "%s%s", dir, UPLOADS_FILE);
+    
+    FILE *fp = fopen(path, "r");
+    while (fp != NULL && fgets(line, BUFLEN, fp) != NULL) {
+        struct stat st;
+        char *name = strchr(line, ' ');
+        if (name == NULL) {
+            continue;
+        }
+        name[strcspn(name, "\n")] = '\0';
+        
+        snprintf(path, BUFLEN, "%s%s", dir, name + 1);
+        if (stat(path, &st) == 0) {
+            fingerprint += fingerprintFile(path, &st);
+        }
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    return fingerprint;
+}
+
+// Fingerprints dir's sources, and in uploaded its uploaded files alone
+uint64_t sourceFingerprint(const char *dir, uint64_t *uploaded) {
+    *uploaded = uploadedFingerprint(dir);
+    return fingerprintSources(dir, BUILD_MAX_DEPTH);
+}
+
+// PGO progress of a progname: instrumented training runs until
+// PGO_TRAINING_RUNS, then an optimised rebuild using the collected profile.
+// Training restarts whenever the sources change.
+struct PgoState {
+    int runs;
+    uint64_t fingerprint;
+};
+
+void readPgoState(const char *dir, uint64_t fingerprint, struct PgoState *state) {
+    char path[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%s", dir, PGO_STATE_FILE);
+    
+    state->runs = 0;
+    state->fingerprint = fingerprint;
+    
+    FILE *fp = fopen(path, "r");
+    if (fp != NULL) {
+        unsigned long long savedFingerprint = 0;
+        int runs = 0;
+        if (fscanf(fp, "%d %llx", &runs, &savedFingerprint) == 2 && savedFingerprint == fingerprint) {
+            state->runs = runs;
+        }
+        fclose(fp);
+    }
+}
+
+void writePgoState(const char *dir, struct PgoState *state) {
+    char value[64] = {0, };
+    snprintf(value, sizeof(value), "%d %llx", state->runs, (unsigned long long) state->fingerprint);
+    writeDirFile(dir, PGO_STATE_FILE, value);
+}
+
+// Works out the gcc flags and the stats key for building with profile.
+// The key is what the build stamp and run time stats are recorded under.
+void profileBuildFlags(const char *dir, const struct BuildProfile *profile, struct PgoState *pgo, char *flags, int flagsLen, char *key, int keyLen) {
+    if (strcmp(profile->name, "pgo") != 0) {
+        snprintf(flags, flagsLen, "%s", profile->flags);
+        snprintf(key, keyLen, "%s", profile->name);
+    } else if (pgo->runs < PGO_TRAINING_RUNS) {
+        snprintf(flags, flagsLen, "-O2 -fprofile-generate=%s%s -fprofile-update=atomic", dir, PGO_DATA_DIR);
+        snprintf(key, keyLen, "pgo-training");
+    } else {
+        snprintf(flags, flagsLen, "%s -fprofile-use=%s%s -fprofile-correction -Wno-missing-profile", profile->flags, dir, PGO_DATA_DIR);
+        snprintf(key, keyLen, "pgo");
+    }
+}
+
+// Adds a run of the key build to dir's run time stats
+void recordRunTime(const char *dir, const char *key, long runTimeUs) {
+    char path[BUFLEN] = {0, };
+    char tempPath[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%s", dir, PROFILE_STATS_FILE);
+    snprintf(tempPath, BUFLEN, "%s%s.%d", dir, PROFILE_STATS_FILE, getpid());
+    
+    FILE *in = fopen(path, "r");
+    FILE *out = fopen(tempPath, "w");
+    if (out == NULL) {
+        if (in != NULL) {
+            fclose(in);
+        }
+        return;
+    }
+    
+    char name[64];
+    long count, totalUs;
+    int found = 0;
+    
+    while (in != NULL && fscanf(in, "%63s %ld %ld", name, &count, &totalUs) == 3) {
+        if (strcmp(name, key) == 0) {
+            count += 1;
+            totalUs += runTimeUs;
+            found = 1;
+        }
+        fprintf(out, "%s %ld %ld\n", name, count, totalUs);
+    }
+    if (found == 0) {
+        fprintf(out, "%s 1 %ld\n", key, runTimeUs);
+    }
+    
+    if (in != NULL) {
+        fclose(in);
+    }
+    fclose(out);
+    rename(tempPath, path);
+}
+
+// Average run time in microseconds of the key build, -1 if it has never run
+double averageRunTime(const char *dir, const char *key) {
+    char path[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%s", dir, PROFILE_STATS_FILE);
     
-    if (k != 3) {
-        free(fileContentsBuffer);
-        return;
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
     }
     
-    char path[BUFLEN] = "";
+    char name[64];
+    long count, totalUs;
+    double average = -1;
     
-    getcwd(path, sizeof(path));
-    strcat(path, "/");
-    strcat(path, commands[1]);
-    strcat(path, "/");
-    strcat(path, commands[2]);
+    while (fscanf(in, "%63s %ld %ld", name, &count, &totalUs) == 3) {
+        if (strcmp(name, key) == 0 && count > 0) {
+            average = (double) totalUs / count;
+        }
+    }
     
-    if (access(path, F_OK) != -1) {
-        if (isFileOrDir(path) == 1) {
-            //printf("file exists\n");
-        } else {
-            // do not send directories
-            send_to_client(ClientSocket, "Can't send directories\n", FILEBUFLEN);
-            free(fileContentsBuffer);
+    fclose(in);
+    return average;
+}
 
-            return;
-        }
+// Describes the profile a run used and its speedup over the default build
+void describeProfile(struct Response *resp, const char *dir, const char *key, struct PgoState *pgo) {
+    double baseline = averageRunTime(dir, "default");
+    double current = averageRunTime(dir, key);
+    
+    respInfo(resp, "Profile: %s", key);
+    if (strcmp(key, "pgo-training") == 0) {
+        respInfo(resp, " (run %d/%d)", pgo->runs, PGO_TRAINING_RUNS);
+    }
+    
+    if (strcmp(key, "default") == 0) {
+        respInfo(resp, "\n");
+    } else if (baseline > 0 && current > 0) {
+        respInfo(resp, ", speedup %.2fx vs default\n", baseline / current);
     } else {
-        //do not send anything to server if any of the files do not exist
-        send_to_client(ClientSocket, "File does not exist\n", FILEBUFLEN);
-        free(fileContentsBuffer);
-        return;
+        respInfo(resp, ", speedup unknown (no default run yet)\n");
+    }
+}
+
+// Calculates time difference, returns result in microseconds
+long calcTDiffUs(struct timespec start) {
+    struct timespec end;
+    clock_gettime(CLOCK_REALTIME, &end);
+    return ((end.tv_nsec - start.tv_nsec)/1000) + ((end.tv_sec - start.tv_sec)*1000000);
+}
+
+// Which build run wants for a progname, worked out before taking the build lock
+struct BuildPlan {
+    const struct BuildProfile *profile;
+    struct PgoState pgo;
+    uint64_t fingerprint;
+    // Of the uploaded files alone, which a project's build doesn't change
+    uint64_t uploaded;
+    char flags[BUFLEN];
+    char key[64];
+    char stamp[BUFLEN];
+    // PROJECT_ kind, and once started the jobs it was given and how it was built
+    int project;
+    int jobs;
+    char tool[64];
+};
+
+void planBuild(const char *dir, struct BuildPlan *plan) {
+    plan->project = projectKind(dir);
+    plan->jobs = 1;
+    plan->tool[0] = '\0';
+    plan->profile = activeProfile(dir);
+    plan->fingerprint = sourceFingerprint(dir, &plan->uploaded);
+    readPgoState(dir, plan->fingerprint, &plan->pgo);
+    profileBuildFlags(dir, plan->profile, &plan->pgo, plan->flags, BUFLEN, plan->key, sizeof(plan->key));
+    snprintf(plan->stamp, BUFLEN, "%s:%llx", plan->key, (unsigned long long) plan->fingerprint);
+}
+
+// 1 if dir's main was built from the current sources with the planned flags
+int isBuildCurrent(const char *dir, struct BuildPlan *plan) {
+    char mainLocation[BUFLEN] = {0, };
+    char savedStamp[BUFLEN] = {0, };
+    snprintf(mainLocation, BUFLEN, "%smain", dir);
+    
+    if (access(mainLocation, F_OK) != 0) {
+        printf("needs recompile -- dne\n");
+        return 0;
+    }
+    if (readDirFile(dir, BUILD_STAMP_FILE, savedStamp, BUFLEN) == 0 || strcmp(plan->stamp, savedStamp) != 0) {
+        printf("needs recompile -- sources or profile changed\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Takes dir's build lock, waiting for any build already going.
+// Returns the descriptor to give to unlockBuild.
+int lockBuild(const char *dir) {
+    char path[BUFLEN] = {0, };
+    snprintf(path, BUFLEN, "%s%s", dir, BUILD_LOCK_FILE);
+    
+    int lockFd = open(path, O_RDWR | O_CREAT, 0644);
+    if (lockFd < 0) {
+        perror("Unable to open build lock");
+        return -1;
     }
+    setCloseOnExec(lockFd);
     
-    FILE *fp = fopen(path, "r");
+    while (flock(lockFd, LOCK_EX) < 0 && errno == EINTR);
+    return lockFd;
+}
+
+void unlockFile(int lockFd) {
+    if (lockFd >= 0) {
+        flock(lockFd, LOCK_UN);
+        close(lockFd);
+    }
+}
+
+// Writes the makefile for the build manifest in the current directory into buildDir,
+// leaving it alone if it hasn't changed as every object depends on it.
+// The manifest has a setting per line and # for comments:
+//   sources src/*.c lib/*.cpp   wildcards relative to the progname, every C and C++ file by default
+//   flags -Iinclude             for compiling and linking everything
+//   cflags, cxxflags            for compiling C or C++ only
+//   libs -lm                    linked in last
+// Returns 0 if the makefile is ready.
+int writeManifestMakefile(struct BuildPlan *plan, const char *buildDir) {
+    static const char *settingNames[] = {"sources", "flags", "cflags", "cxxflags", "libs"};
+    static const char *cxxExtensions[] = {"cc", "cpp", "cxx"};
+    char settings[5][BUFLEN] = {{0, }, };
+    char line[BUFLEN] = {0, };
+    char path[BUFLEN] = {0, };
+    
+    FILE *fp = fopen(BUILD_MANIFEST_FILE, "r");
+    if (fp == NULL) {
+        perror("Unable to read build manifest");
+        return -1;
+    }
+    while (fgets(line, BUFLEN, fp) != NULL) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *value = line + strcspn(line, " \t");
+        if (*value != '\0') {
+            *value++ = '\0';
+        }
+        for (int i = 0; i < 5; i++) {
+            if (strcmp(line, settingNames[i]) == 0) {
+                strncat(settings[i], " ", BUFLEN - strlen(settings[i]) - 1);
+                strncat(settings[i], value, BUFLEN - strlen(settings[i]) - 1);
+            }
+        }
+    }
+    fclose(fp);
+    if (settings[0][0] == '\0') {
+        snprintf(settings[0], BUFLEN, "*.c *.cc *.cpp *.cxx");
+    }
+    
+    // Objects go under buildDir/obj mirroring the sources, with dependencies from -MMD.
+    // C++ links with $(CXX) if there's any.
+    char *makefile = malloc(MANIFEST_MAKEFILE_MAX);
+    int len = snprintf(makefile, MANIFEST_MAKEFILE_MAX,
+                       "# Generated from " BUILD_MANIFEST_FILE ", run from the progname\n"
+                       "B := %s\n"
+                       "SOURCES := $(wildcard %s)\n"
+                       "OBJECTS := $(SOURCES:%%=$(B)/obj/%%.o)\n"
+                       "FLAGS := %s %s\n"
+                       "$(B)/main: $(OBJECTS)\n"
+                       "\t$(if $(filter-out %%.c,$(SOURCES)),$(CXX),$(CC)) $(FLAGS) -o $@ $(OBJECTS) %s\n"
+                       "$(B)/obj/%%.c.o: %%.c $(B)/Makefile\n"
+                       "\t@mkdir -p $(@D)\n"
+                       "\t$(CC) $(FLAGS) %s -MMD -MP -c $< -o $@\n",
+                       buildDir, settings[0], plan->flags, settings[1], settings[4], settings[2]);
+    for (int i = 0; i < 3 && len < MANIFEST_MAKEFILE_MAX; i++) {
+        len += snprintf(makefile + len, MANIFEST_MAKEFILE_MAX - len,
+                        "$(B)/obj/%%.%s.o: %%.%s $(B)/Makefile\n"
+                        "\t@mkdir -p $(@D)\n"
+                        "\t$(CXX) $(FLAGS) %s -MMD -MP -c $< -o $@\n",
+                        cxxExtensions[i], cxxExtensions[i], settings[3]);
+    }
+    if (len < MANIFEST_MAKEFILE_MAX) {
+        len += snprintf(makefile + len, MANIFEST_MAKEFILE_MAX - len, "-include $(OBJECTS:.o=.d)\n");
+    }
+    if (len >= MANIFEST_MAKEFILE_MAX) {
+        printf("build manifest too long\n");
+        free(makefile);
+        return -1;
+    }
     
-    // Send
+    // Only rewritten when it changes, or everything would build again
+    char *old = malloc(MANIFEST_MAKEFILE_MAX);
+    int oldLen = 0;
+    snprintf(path, BUFLEN, "%s/Makefile", buildDir);
+    fp = fopen(path, "r");
     if (fp != NULL) {
-        size_t newLen = fread(fileContentsBuffer, sizeof(char), FILEBUFLEN, fp);
-        if (ferror(fp) != 0) {
-            send_to_client(ClientSocket, "Error reading file!", FILEBUFLEN);
+        oldLen = (int) fread(old, 1, MANIFEST_MAKEFILE_MAX, fp);
+        fclose(fp);
+    }
+    
+    int result = 0;
+    if (oldLen != len || memcmp(old, makefile, len) != 0) {
+        fp = fopen(path, "w");
+        if (fp == NULL || fwrite(makefile, 1, len, fp) != (size_t) len) {
+            perror("Unable to write manifest makefile");
+            result = -1;
+        }
+        if (fp != NULL) {
             fclose(fp);
+        }
+    }
+    
+    free(old);
+    free(makefile);
+    return result;
+}
+
+// Starts building the progname in the current directory with the plan's flags,
+// with the server's build jobs split between the builds going at once.
+// The binary goes to tempName so a failed or stale build never replaces main.
+FILE *startCompile(struct BuildPlan *plan, char *tempName, int tempNameLen) {
+    char compileCmd[BUFLEN * 4] = {0, };
+    char buildDir[BUFLEN] = {0, };
+    char flags[BUFLEN * 3] = {0, };
+    
+    long building = statAdd(&Stats->activeBuilds, 1);
+    plan->jobs = Config.buildJobs / building > 1 ? Config.buildJobs / building : 1;
+    
+    snprintf(tempName, tempNameLen, "main.tmp.%d", getpid());
+    snprintf(buildDir, BUFLEN, "%s/%s", BUILD_DIR, plan->key);
+    if (plan->project == PROJECT_CMAKE || plan->project == PROJECT_MANIFEST) {
+        mkdir(BUILD_DIR, 0755);
+        mkdir(buildDir, 0755);
+    }
+    
+    if (plan->project == PROJECT_MAKE) {
+        // Builds in place, so a different profile means building everything again.
+        // The profile's flags only reach makefiles that add to CFLAGS rather than set it.
+        char savedStamp[BUFLEN] = {0, };
+        int changed = readDirFile("", BUILD_STAMP_FILE, savedStamp, BUFLEN) &&
+                      (strncmp(savedStamp, plan->key, strlen(plan->key)) != 0 || savedStamp[strlen(plan->key)] != ':');
+        
+        if (plan->flags[0] != '\0') {
+            snprintf(flags, sizeof(flags), "CFLAGS='%s' CXXFLAGS='%s' LDFLAGS='%s' ", plan->flags, plan->flags, plan->flags);
+        }
+        snprintf(compileCmd, sizeof(compileCmd), "%smake -j%d%s 2>&1", flags, plan->jobs, changed ? " -B" : "");
+    } else if (plan->project == PROJECT_CMAKE) {
+        // Configured once per profile, cmake --build configures again itself when it has to
+        snprintf(compileCmd, sizeof(compileCmd),
+                 "( (test -f %s/CMakeCache.txt || cmake -S . -B %s -DCMAKE_C_FLAGS='%s' -DCMAKE_CXX_FLAGS='%s' -DCMAKE_EXE_LINKER_FLAGS='%s')"
+                 " && cmake --build %s -j %d ) 2>&1",
+                 buildDir, buildDir, plan->flags, plan->flags, plan->flags, buildDir, plan->jobs);
+    } else if (plan->project == PROJECT_MANIFEST) {
+        if (writeManifestMakefile(plan, buildDir) < 0) {
+            statAdd(&Stats->activeBuilds, -1);
+            return NULL;
+        }
+        snprintf(compileCmd, sizeof(compileCmd), "make -f %s/Makefile -j%d 2>&1", buildDir, plan->jobs);
+    } else {
+        snprintf(compileCmd, sizeof(compileCmd), "gcc %s *.c -o %s 2>&1", plan->flags, tempName);
+    }
+    
+    if (plan->project == PROJECT_GCC) {
+        snprintf(plan->tool, sizeof(plan->tool), "gcc *.c");
+    } else {
+        snprintf(plan->tool, sizeof(plan->tool), "%s -j%d", projectNames[plan->project], plan->jobs);
+    }
+    printf("compileCmd: %s\n", compileCmd);
+    
+    FILE *compile = popen(compileCmd, "r");
+    if (compile == NULL) {
+        statAdd(&Stats->activeBuilds, -1);
+    }
+    return compile;
+}
+
+// Waits for the compile and moves the binary into place as dir's main, unless it
+// failed or the sources changed while it ran. Returns 0 if main was replaced.
+int finishCompile(FILE *compile, const char *dir, struct BuildPlan *plan, const char *tempName, const char *builtBy) {
+    int result = pclose(compile);
+    statAdd(&Stats->activeBuilds, -1);
+    
+    // A project can generate sources as it builds, so for one only the uploaded
+    // files have to be as they were, and it's stamped with what's there once it's done
+    uint64_t uploaded;
+    uint64_t fingerprint = sourceFingerprint(dir, &uploaded);
+    int changed = plan->project == PROJECT_GCC ? fingerprint != plan->fingerprint : uploaded != plan->uploaded;
+    if (result == 0 && changed) {
+        printf("discarding build of %s -- sources changed while compiling\n", dir);
+        result = -1;
+    } else if (result == 0 && plan->project != PROJECT_GCC) {
+        plan->fingerprint = fingerprint;
+        snprintf(plan->stamp, BUFLEN, "%s:%llx", plan->key, (unsigned long long) plan->fingerprint);
+    }
+    
+    // Makefiles build main in place, the others in the build directory
+    if (result == 0 && (plan->project == PROJECT_CMAKE || plan->project == PROJECT_MANIFEST)) {
+        char target[BUFLEN] = {0, };
+        snprintf(target, BUFLEN, "%s/%s/main", BUILD_DIR, plan->key);
+        if (link(target, tempName) < 0) {
+            printf("build of %s made no %s\n", dir, target);
+            result = -1;
+        }
+    } else if (result == 0 && plan->project == PROJECT_MAKE && access("main", X_OK) != 0) {
+        printf("build of %s made no main\n", dir);
+        return -1;
+    }
+    if (result != 0) {
+        unlink(tempName);
+        return -1;
+    }
+    
+    if (plan->project != PROJECT_MAKE && rename(tempName, "main") < 0) {
+        perror("Unable to move build into place");
+        unlink(tempName);
+        return -1;
+    }
+    writeDirFile(dir, BUILD_STAMP_FILE, plan->stamp);
+    writeDirFile(dir, BUILT_BY_FILE, builtBy);
+    return 0;
+}
+
+// A background builder's temporary binary and its locked pid file, for
+// sig_cancel to clean up. Set only in the builder.
+char BuilderTemp[BUFLEN] = "";
+char BuilderPidFile[BUFLEN] = "";
+int BuilderPidFd = -1;
+// 1 while the builder's compile is going
+volatile sig_atomic_t BuilderCompiling = 0;
+
+// 1 if path still names the file open as fd
+int isFileAt(int fd, const char *path) {
+    struct stat fdStat, pathStat;
+    return fstat(fd, &fdStat) == 0 && stat(path, &pathStat) == 0 &&
+           fdStat.st_ino == pathStat.st_ino && fdStat.st_dev == pathStat.st_dev;
+}
+
+// Removes a background builder's pid file, unless a newer builder has replaced it
+void removeBuilderPidFile(void) {
+    if (isFileAt(BuilderPidFd, BuilderPidFile)) {
+        unlink(BuilderPidFile);
+    }
+}
+
+// A background build was cancelled. A compile going is killed along with us, as
+// it's in our process group, and finishCompile cleans up after it. Otherwise
+// there's nothing left to do but remove our files.
+void sig_cancel(int signum) {
+    if (BuilderCompiling) {
+        return;
+    }
+    unlink(BuilderTemp);
+    removeBuilderPidFile();
+    _exit(1);
+}
+
+// Stops a background build of dir that a newer put has made stale. Its builder
+// holds a lock on BACKGROUND_BUILD_FILE for as long as it runs, so a pid left
+// behind by a builder that's gone, maybe reused since, is never signalled.
+void cancelBackgroundBuild(const char *dir) {
+    char path[BUFLEN] = {0, };
+    char pid[32] = {0, };
+    
+    snprintf(path, BUFLEN, "%s%s", dir, BACKGROUND_BUILD_FILE);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    
+    if (flock(fd, LOCK_SH | LOCK_NB) < 0 && errno == EWOULDBLOCK &&
+        pread(fd, pid, sizeof(pid) - 1, 0) > 0 && atoi(pid) > 0) {
+        // The builder leads its own process group, so this takes gcc with it
+        if (kill(-atoi(pid), SIGTERM) == 0) {
+            printf("cancelled stale background build %s\n", pid);
+        }
+    }
+    close(fd);
+}
+
+// Compiles dir at low priority now that a put has finished, so that the
+// binary is usually ready by the time run asks for it
+void startBackgroundBuild(const char *dir) {
+    struct BuildPlan plan;
+    char pidPath[BUFLEN] = {0, };
+    int pidFd = -1;
+    
+    planBuild(dir, &plan);
+    if (plan.fingerprint == 0) {
+        // No sources to build
+        return;
+    }
+    
+    // One builder per progname, any older one is out of date. Locking its pid file
+    // waits for it to clean up, which removes the file, so it's opened again until
+    // the one locked is the one at the path.
+    cancelBackgroundBuild(dir);
+    snprintf(pidPath, BUFLEN, "%s%s", dir, BACKGROUND_BUILD_FILE);
+    do {
+        if (pidFd >= 0) {
+            close(pidFd);
+        }
+        pidFd = open(pidPath, O_RDWR | O_CREAT, 0644);
+        if (pidFd < 0) {
+            perror("Unable to open background build file");
             return;
+        }
+        while (flock(pidFd, LOCK_EX) < 0 && errno == EINTR);
+    } while (isFileAt(pidFd, pidPath) == 0);
+    setCloseOnExec(pidFd);
+    ftruncate(pidFd, 0);
+    
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            perror("Background build fork failed with error");
         } else {
-            fileContentsBuffer[newLen++] = '\0'; /* Just to be safe */
+            // The builder's pid is in the file before put replies, and the builder
+            // is in its own group already, so the next put can cancel it straight away
+            setpgid(pid, pid);
+            dprintf(pidFd, "%d", pid);
         }
-        fclose(fp);
+        // The builder has the lock now
+        close(pidFd);
+        return;
     }
     
-    // Make and send response
-    snprintf(responseTime, 63, "\nTook: %lums\n", calcTDiff(start));
-    strcat(fileContentsBuffer, "\n");
-    strcat(fileContentsBuffer, responseTime);
+    BuilderPidFd = pidFd;
+    snprintf(BuilderPidFile, BUFLEN, "%s", pidPath);
+    snprintf(BuilderTemp, BUFLEN, "%smain.tmp.%d", dir, getpid());
+    signal(SIGTERM, sig_cancel);
     
-    send_to_client(ClientSocket, fileContentsBuffer, FILEBUFLEN);
+    // Drop the client and listening sockets so the builder never holds a connection open
+    for (int fd = 3; fd < 1024; fd++) {
+        if (fd != TraceFd && fd != BuilderPidFd) {
+            close(fd);
+        }
+    }
     
-    free(fileContentsBuffer);
-    return;
+    // Traced as part of the put that started it
+    traceCommandStart("background compile");
+    
+    setpgid(0, 0);
+    setpriority(PRIO_PROCESS, 0, BACKGROUND_BUILD_NICE);
+    signal(SIGCHLD, SIG_DFL);
+    
+    int lockFd = lockBuild(dir);
+    
+    // run may have built it while this waited for the lock
+    if (chdir(dir) == 0 && isBuildCurrent(dir, &plan) == 0) {
+        char tempName[64] = {0, };
+        char line[BUFLEN] = {0, };
+        BuilderCompiling = 1;
+        FILE *compile = startCompile(&plan, tempName, sizeof(tempName));
+        
+        // Nobody is waiting on the output, run compiles again to show any errors
+        while (compile != NULL && fgets(line, BUFLEN, compile) != NULL);
+        
+        if (compile != NULL && finishCompile(compile, dir, &plan, tempName, "background") == 0) {
+            printf("background build of %s done\n", dir);
+        }
+        BuilderCompiling = 0;
+    }
+    
+    unlockFile(lockFd);
+    removeBuilderPidFile();
+    exit(0);
 }
 
-// Runs list cmd
-void listCmd(int ClientSocket, char **commands, int noCommands) {
-    FILE *sys;
-    struct timespec start;
-    char responseTime[64];
-    clock_gettime(CLOCK_REALTIME, &start);
+// profile progname [name] : shows or sets the build profile used by run
+void profileCmd(int ClientSocket, char **commands, int k) {
+    struct Response resp;
+    char dir[BUFLEN] = {0, };
     
-    // Builds ls command to run with popen
-    char cmd[40] = "ls ";
+    if (k < 2 || k > 3) {
+        send_to_client(ClientSocket, "profile usage: \"profile progname [name]\"\n");
+        return;
+    }
     
-    if (noCommands == 1) {
-        strcat(cmd, ". ");
-    } else if (noCommands == 2) {
-        if (strcmp(commands[1], "-l") == 0) {
-            strcat(cmd, "-l ");
+    getcwd(dir, sizeof(dir));
+    strcat(dir, "/");
+    strcat(dir, commands[1]);
+    strcat(dir, "/");
+    
+    if (access(dir, F_OK) != 0) {
+        send_to_client(ClientSocket, "Can't set profile as the directory doesn't exist\n");
+        return;
+    }
+    
+    respInit(&resp, ClientSocket);
+    
+    if (k == 3) {
+        if (findProfile(commands[2]) == NULL) {
+            respInfo(&resp, "Unknown profile, use one of:");
+            for (int i = 0; i < NO_BUILD_PROFILES; i++) {
+                respInfo(&resp, " %s", buildProfiles[i].name);
+            }
+            respInfo(&resp, "\n");
+            respEnd(&resp);
+            return;
         }
-        strcat(cmd, commands[1]);
-    } else if (noCommands == 3) {
-        if (strcmp(commands[1], "-l") == 0) {
-            strcat(cmd, "-l ");
+        writeDirFile(dir, BUILD_PROFILE_FILE, commands[2]);
+    }
+    
+    const struct BuildProfile *profile = activeProfile(dir);
+    respInfo(&resp, "%s uses profile %s\n", commands[1], profile->name);
+    
+    // Average run time of every build that has run
+    const char *keys[] = {"default", "debug", "O2", "native", "lto", "pgo-training", "pgo"};
+    for (int i = 0; i < (int) (sizeof(keys) / sizeof(keys[0])); i++) {
+        double average = averageRunTime(dir, keys[i]);
+        if (average > 0) {
+            respInfo(&resp, "  %-12s avg %.3fms\n", keys[i], average / 1000);
         }
-        strcat(cmd, commands[2]);
-    } else {
-        strcat(cmd, commands[1]);
     }
     
-    // to redirect stderr too
-    strcat(cmd, " 2>&1");
-    sys = popen(cmd, "r");
+    respEnd(&resp);
+}
+
+// Memo settings of the progname in dir, returns 0 if its runs aren't memoized
+int readMemoSettings(const char *dir, long *ttl, long *maxBytes) {
+    char value[64] = {0, };
     
+    *ttl = MEMO_TTL;
+    *maxBytes = MEMO_MAX_BYTES;
+    if (readDirFile(dir, MEMO_FILE, value, sizeof(value)) == 0) {
+        return 0;
+    }
+    sscanf(value, "%ld:%ld", ttl, maxBytes);
+    return 1;
+}
+
+// Fingerprint of what a program in dir could read besides its own binary:
+// every file that isn't build state, main or a build in progress
+uint64_t inputFingerprint(const char *dir) {
+    uint64_t fingerprint = 0;
+    DIR *d = opendir(dir);
+    struct dirent *entry;
     
-    // Read popen
-    char buf[BUFLEN] = {0, };
-    char line[BUFLEN] = {0, };
+    if (d == NULL) {
+        return 0;
+    }
+    
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.' || strcmp(entry->d_name, "main") == 0 || strncmp(entry->d_name, "main.tmp.", 9) == 0) {
+            continue;
+        }
+        
+        char path[BUFLEN] = {0, };
+        struct stat st;
+        snprintf(path, BUFLEN, "%s%s", dir, entry->d_name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        
+        uint64_t hash = 14695981039346656037ULL;
+        hash = fnv1a(hash, entry->d_name, strlen(entry->d_name));
+        hash = fnv1a(hash, &st.st_ino, sizeof(st.st_ino));
+        hash = fnv1a(hash, &st.st_size, sizeof(st.st_size));
+        hash = fnv1a(hash, &st.st_mtime, sizeof(st.st_mtime));
+        fingerprint += hash;
+    }
+    
+    closedir(d);
+    return fingerprint;
+}
+
+// Hashes dir's main, its inputs and argv into the key of a memoized run.
+// Returns 0 if main can't be read.
+int memoKey(const char *dir, char **argv, char *keyHex) {
+    char path[BUFLEN] = {0, };
+    unsigned char digest[HASH_LEN];
+    struct Sha256 ctx;
+    long size;
+    
+    snprintf(path, BUFLEN, "%smain", dir);
+    unsigned char *binary = readWholeFile(path, &size);
+    if (binary == NULL) {
+        return 0;
+    }
+    sha256(binary, size, digest);
+    free(binary);
+    
+    uint64_t inputs = inputFingerprint(dir);
+    sha256Init(&ctx);
+    sha256Update(&ctx, digest, HASH_LEN);
+    sha256Update(&ctx, &inputs, sizeof(inputs));
+    for (int i = 0; argv[i] != NULL; i++) {
+        sha256Update(&ctx, argv[i], strlen(argv[i]) + 1);
+    }
+    sha256Final(&ctx, digest);
+    hashToHex(digest, keyHex);
+    return 1;
+}
+
+// Sends the output of a memoized run of key if there's one younger than ttl.
+// Returns 1 with the run's wait status and age in seconds, 0 if there isn't one.
+int replayMemo(struct Response *resp, const char *dir, const char *key, long ttl, int *status, long *age) {
+    char path[BUFLEN] = {0, };
+    char header[MEMO_HEADER_LEN + 1] = {0, };
+    struct stat st;
+    
+    snprintf(path, BUFLEN, "%s%s/%s", dir, MEMO_DIR, key);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    
+    *age = (long) (time(NULL) - (fstat(fd, &st) == 0 ? st.st_mtime : 0));
+    if (*age > ttl || read(fd, header, MEMO_HEADER_LEN) != MEMO_HEADER_LEN) {
+        close(fd);
+        unlink(path);
+        return 0;
+    }
+    
+    *status = atoi(header);
+    respAppendFd(resp, FRAME_DATA, fd);
+    close(fd);
+    return 1;
+}
+
+// Opens a temp file in dir's memo cache to keep a run's output in, -1 if it can't
+int startMemo(const char *dir, char *tempPath, int len) {
+    char memoDir[BUFLEN] = {0, };
+    
+    snprintf(memoDir, BUFLEN, "%s%s", dir, MEMO_DIR);
+    mkdir(memoDir, 0755);
+    snprintf(tempPath, len, "%s/tmp.%d", memoDir, getpid());
+    
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        setCloseOnExec(fd);
+        // The status goes in front once the program exits
+        lseek(fd, MEMO_HEADER_LEN, SEEK_SET);
+    }
+    return fd;
+}
+
+struct MemoEntry {
+    char name[HASH_HEX_LEN + 1];
+    long size;
+    time_t mtime;
+};
+
+int compareMemoAge(const void *a, const void *b) {
+    const struct MemoEntry *x = a, *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Removes the oldest results in dir's memo cache until the rest fit in maxBytes.
+// Returns the bytes left, with the number of results left in count.
+long trimMemos(const char *dir, long maxBytes, int *count) {
+    char memoDir[BUFLEN] = {0, };
+    char path[BUFLEN] = {0, };
+    struct MemoEntry *entries = NULL;
+    struct dirent *entry;
+    struct stat st;
+    int noEntries = 0;
+    long total = 0;
+    
+    *count = 0;
+    snprintf(memoDir, BUFLEN, "%s%s", dir, MEMO_DIR);
+    DIR *d = opendir(memoDir);
+    if (d == NULL) {
+        return 0;
+    }
+    
+    while ((entry = readdir(d)) != NULL) {
+        snprintf(path, BUFLEN, "%s/%s", memoDir, entry->d_name);
+        if (strlen(entry->d_name) != HASH_HEX_LEN || stat(path, &st) != 0) {
+            continue;
+        }
+        
+        struct MemoEntry *grown = realloc(entries, (noEntries + 1) * sizeof(struct MemoEntry));
+        if (grown == NULL) {
+            break;
+        }
+        entries = grown;
+        strcpy(entries[noEntries].name, entry->d_name);
+        entries[noEntries].size = (long) st.st_size;
+        entries[noEntries].mtime = st.st_mtime;
+        total += (long) st.st_size;
+        noEntries++;
+    }
+    closedir(d);
+    
+    if (total > maxBytes) {
+        qsort(entries, noEntries, sizeof(struct MemoEntry), compareMemoAge);
+    }
+    *count = noEntries;
+    for (int i = 0; i < noEntries && total > maxBytes; i++) {
+        snprintf(path, BUFLEN, "%s/%s", memoDir, entries[i].name);
+        if (unlink(path) == 0) {
+            total -= entries[i].size;
+            *count -= 1;
+        }
+    }
+    
+    free(entries);
+    return total;
+}
+
+// Keeps the output in tempPath as the result for key if the program exited normally
+// and its output fitted, then trims the cache back to maxBytes
+void finishMemo(int fd, const char *tempPath, const char *dir, const char *key, int status, long outputLen, long maxBytes) {
+    char header[MEMO_HEADER_LEN + 1];
+    char path[BUFLEN] = {0, };
+    int count;
+    
+    if (status == -1 || WIFEXITED(status) == 0 || outputLen > MEMO_MAX_ENTRY) {
+        close(fd);
+        unlink(tempPath);
+        return;
+    }
+    
+    snprintf(header, sizeof(header), "%-*d\n", MEMO_HEADER_LEN - 1, status);
+    pwrite(fd, header, MEMO_HEADER_LEN, 0);
+    close(fd);
+    
+    snprintf(path, BUFLEN, "%s%s/%s", dir, MEMO_DIR, key);
+    if (rename(tempPath, path) < 0) {
+        unlink(tempPath);
+        return;
+    }
+    trimMemos(dir, maxBytes, &count);
+}
+
+// Reports how a program run by run ended, if it didn't just exit with 0
+void respExitStatus(struct Response *resp, int status) {
+    if (status == -1) {
+        respInfo(resp, "Unable to get exit status\n");
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        respInfo(resp, "Exit code: %d\n", WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        respInfo(resp, "Killed by signal %d\n", WTERMSIG(status));
+    }
+}
+
+// memo progname [on [ttl-seconds [max-bytes]]|off]
+void memoCmd(int ClientSocket, char **commands, int k) {
+    struct Response resp;
+    char dir[BUFLEN] = {0, };
+    char value[64] = {0, };
+    long ttl, maxBytes;
+    int count;
+    
+    if (k < 2 || k > 5 || (k >= 3 && strcmp(commands[2], "on") != 0 && strcmp(commands[2], "off") != 0)) {
+        send_to_client(ClientSocket, "memo usage: \"memo progname [on [ttl-seconds [max-bytes]]|off]\"\n");
+        return;
+    }
+    
+    getcwd(dir, sizeof(dir));
+    strcat(dir, "/");
+    strcat(dir, commands[1]);
+    strcat(dir, "/");
+    
+    if (access(dir, F_OK) != 0) {
+        send_to_client(ClientSocket, "Can't memoize as the directory doesn't exist\n");
+        return;
+    }
+    
+    respInit(&resp, ClientSocket);
+    
+    if (k >= 3 && strcmp(commands[2], "on") == 0) {
+        snprintf(value, sizeof(value), "%ld:%ld", k >= 4 ? atol(commands[3]) : (long) MEMO_TTL, k >= 5 ? atol(commands[4]) : MEMO_MAX_BYTES);
+        writeDirFile(dir, MEMO_FILE, value);
+    } else if (k >= 3) {
+        char path[BUFLEN] = {0, };
+        snprintf(path, BUFLEN, "%s%s", dir, MEMO_FILE);
+        unlink(path);
+        trimMemos(dir, 0, &count);
+    }
+    
+    if (readMemoSettings(dir, &ttl, &maxBytes) == 0) {
+        respInfo(&resp, "%s: runs are not memoized\n", commands[1]);
+    } else {
+        long used = trimMemos(dir, maxBytes, &count);
+        respInfo(&resp, "%s: runs are memoized for %lds, %d results kept in %ld of %ld bytes\n", commands[1], ttl, count, used, maxBytes);
+    }
+    respEnd(&resp);
+}
+
+// Strips run's trailing -f localfile and -i input, which are for the client.
+// Returns 1 if the client streams the program's stdin after the command.
+int runClientOptions(char **commands, int *k, int *localFile) {
+    int streamed = 0;
+    
+    *localFile = 0;
+    while (*k >= 4 && (strcmp(commands[*k - 2], "-f") == 0 || strcmp(commands[*k - 2], "-i") == 0)) {
+        if (strcmp(commands[*k - 2], "-f") == 0) {
+            *localFile = 1;
+        } else {
+            streamed = 1;
+        }
+        *k -= 2;
+    }
+    return streamed;
+}
+
+// Forks the process that writes the client's DATA frames to inFd, the program's
+// stdin, until the END frame. Writes block while the program isn't reading, which
+// in turn stops the client sending. Anything that arrives once the program has
+// stopped reading is thrown away, as the frames have to come off the connection.
+pid_t forwardStdin(int ClientSocket, int inFd) {
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
     
-    while(fgets(line, BUFLEN, sys) != NULL) {
-        strcat(buf, line);
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            perror("Stdin fork failed with error");
+        }
+        return pid;
     }
     
-    fclose(sys);
-    
-    // Make and send response
-    snprintf(responseTime, 63, "\nTook: %lums\n", calcTDiff(start));
+    unsigned char *buffer = malloc(SYNC_CHUNK_LEN);
+    long forwarded = 0, dropped = 0;
+    int type, len, reading = 1;
+    signal(SIGPIPE, SIG_IGN);
     
-    strcat(buf, "\n");
-    strcat(buf, responseTime);
+    // The run is traced as the command, this is its own span
+    TraceCommand[0] = '\0';
     
-    send_to_client(ClientSocket, buf, BUFLEN);
+    // Holding the program's end would keep writes from failing once it exits
+    close(StdinPipe);
     
-    return;
+    while ((len = receiveFrame(ClientSocket, &type, buffer, SYNC_CHUNK_LEN)) >= 0 && type == FRAME_DATA) {
+        for (int written = 0; reading && written < len;) {
+            ssize_t n = write(inFd, buffer + written, len - written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                reading = 0;
+                break;
+            }
+            written += (int) n;
+        }
+        if (reading) {
+            forwarded += len;
+        } else {
+            dropped += len;
+        }
+    }
+    close(inFd);
     
+    char detail[64] = {0, };
+    snprintf(detail, sizeof(detail), "%ld bytes, %ld unread", forwarded, dropped);
+    traceSince("stdin", &start, detail);
+    exit(0);
 }
 
-// splits input and updates k
-// input "in p ut" -> ["in", "p", "ut"]; k = 3
-char** separateCommands(char * input, int* nk) {
-    char *inputCopy = input;
-    char delim[5] = " \n\0";
-    printf("input %s\n", input);
-    static char *commands[64] = {0, };
-
-    int k = 0;
-    
-    commands[k] = strtok(inputCopy, delim);
-    
-    while( commands[k] != NULL ) {
-        k++;
-        commands[k] = strtok(NULL, delim);
+// Waits for the client's stdin to be taken off the connection, as the next command follows it
+void finishStdin(void) {
+    if (StdinPipe >= 0) {
+        close(StdinPipe);
+        StdinPipe = -1;
     }
-    
-    printf("Commands: [");
-    for (int i = 0; i < k; i++) {
-        if (i == (k-1)) {
-            printf("%s", commands[i]);
-        } else {
-            printf("%s, ", commands[i]);
-        }
+    if (StdinForwarder > 0) {
+        while (waitpid(StdinForwarder, NULL, 0) < 0 && errno == EINTR);
+        StdinForwarder = 0;
     }
-    printf("]\n");
-    
-    // Assign k, basicially returning 2 params but not
-    *nk = k;
-    return commands;
 }
 
 // run progname args [-f localfile]
 void runCmd(int ClientSocket, char **commands, int k) {
     struct timespec start;
-    char responseTime[64];
+    struct Response resp;
     clock_gettime(CLOCK_REALTIME, &start);
     
-    char returnBuffer[BUFLEN] = {0, };
-    char cmd[BUFLEN] = {0, };
-    
-    int needsRecompile = 0;
-    
     char tempDirBuffer[BUFLEN] = {0, };
     getcwd(tempDirBuffer, sizeof(tempDirBuffer));
     strcat(tempDirBuffer, "/");
     strcat(tempDirBuffer, commands[1]);
     strcat(tempDirBuffer, "/");
     
+    // The program's stdin is fed from the start, so that the client's input is
+    // taken off the connection however the run turns out
+    int localFile, inPipe[2];
+    int streamed = runClientOptions(commands, &k, &localFile);
+    if (streamed && pipe(inPipe) == 0) {
+        setCloseOnExec(inPipe[0]);
+        StdinPipe = inPipe[0];
+        StdinForwarder = forwardStdin(ClientSocket, inPipe[1]);
+        close(inPipe[1]);
+    }
+    
     // Error checking
-    if (k > 2) {
-        // used to be 2
-        if (access(commands[1], F_OK) != 0) {
-            send_to_client(ClientSocket, "Can't run/compile as the directory doesn't exist\n", BUFLEN);
-            return;
-        }
+    if (k < 2 || access(commands[1], F_OK) != 0) {
+        send_to_client(ClientSocket, "Can't run/compile as the directory doesn't exist\n");
+        return;
     }
     
-    // Ready to run
-    if (k >= 2) {
-        char mainLocation[BUFLEN] = {0, };
-        strcpy(mainLocation, tempDirBuffer);
-        strcat(mainLocation, "main");
-        int accessResult = access(mainLocation, F_OK);
-        if (accessResult == 0) {
-            // File exists
-            // check age [ project.c -nt main ] && echo yes
-            FILE *sys;
-            
-            char checkNtCommand[BUFLEN] = {0,};
-            //strcat(checkNtCommand, "[ ");
-            //strcat(checkNtCommand, commands[1]);
-            strcat(checkNtCommand, "[ *.c -ot main ] && echo yes");
-            
-            sys = popen(checkNtCommand, "r");
-            char line[BUFLEN]={0,};
-            
-            while(fgets(line, BUFLEN, sys) != NULL) {
-                if (line[0] == 'y') {
-                    printf("needs recompile -- newer source\n");
-                    needsRecompile = 1;
-                }
-            }
-            
-        } else {
-            //dsa
-            // does not exist
-            printf("determined main does not exist, accessResult: %d", accessResult);
-            printf("needs recompile -- dne\n");
-            needsRecompile = 1;
-        }
-        
-        strcat(cmd, "./main ");
-        for (int i = 2; i < k; i++) {
-            strcat(cmd, commands[i]);
-            strcat(cmd, " ");
-        }
-        strcat(cmd, "2>&1");
-        printf("cmd: %s\n", cmd);
+    // Work out which build the profile wants
+    struct BuildPlan plan;
+    planBuild(tempDirBuffer, &plan);
+    
+    char *argv[64] = {"./main", };
+    for (int i = 2; i < k && i < 64; i++) {
+        argv[i - 1] = commands[i];
     }
     
-    if (needsRecompile == 1) {
-        chdir(tempDirBuffer);
-        char compileCmd[BUFLEN] = {0, };
-        // commands[1] == progname, must be named progname.c
-        strcat(compileCmd, "gcc *.c -o main 2>&1 && ");
-        //strcat(compileCmd, commands[1]);
-        //strcat(compileCmd, ".c ");
-        //strcat(compileCmd, "");
-        
-        // to redirect stderr too
-        strcat(compileCmd, cmd);
-        
-        printf("compileCmd: %s\n", compileCmd);
-        
-        FILE *sys;
-        sys = popen(compileCmd, "r");
-        char line[BUFLEN]={0,};
+    respInit(&resp, ClientSocket);
+    chdir(tempDirBuffer);
+    
+    // Waits here if a background build from put is still going
+    statAdd(&Stats->buildWaiting, 1);
+    int lockFd = lockBuild(tempDirBuffer);
+    statAdd(&Stats->buildWaiting, -1);
+    char builtBy[96] = {0, };
+    
+    int current = isBuildCurrent(tempDirBuffer, &plan);
+    statAdd(current ? &Stats->buildHits : &Stats->buildMisses, 1);
+    
+    if (current == 0) {
+        struct timespec compileStart;
+        char tempName[64] = {0, };
+        clock_gettime(CLOCK_REALTIME, &compileStart);
         
-        while(fgets(line, BUFLEN, sys) != NULL) {
-            strcat(returnBuffer, line);
+        // Compiler output is from the server, not the program
+        FILE *compile = startCompile(&plan, tempName, sizeof(tempName));
+        if (compile != NULL) {
+            respAppendFd(&resp, FRAME_INFO, fileno(compile));
         }
         
-        fclose(sys);
-        chdir("..");
+        int compiled = compile != NULL && finishCompile(compile, tempDirBuffer, &plan, tempName, "run") == 0;
+        traceSince("compile", &compileStart, plan.tool);
         
-        snprintf(responseTime, 63, "\nTook: %lums\n", calcTDiff(start));
-        strcat(returnBuffer, "\n");
-        strcat(returnBuffer, responseTime);
-        send_to_client(ClientSocket, returnBuffer, BUFLEN);
+        if (compiled == 0) {
+            unlockFile(lockFd);
+            chdir("..");
+            respInfo(&resp, "\nCompile failed\nTook: %lums\n", calcTDiff(start));
+            respEnd(&resp);
+            return;
+        }
         
+        snprintf(builtBy, sizeof(builtBy), "compiled in %lums with %s", calcTDiff(compileStart), plan.tool);
+    } else if (readDirFile(tempDirBuffer, BUILT_BY_FILE, builtBy, sizeof(builtBy)) && strcmp(builtBy, "background") == 0) {
+        snprintf(builtBy, sizeof(builtBy), "prebuilt in background");
+        writeDirFile(tempDirBuffer, BUILT_BY_FILE, "background, used");
     } else {
-        chdir(tempDirBuffer);
-        FILE *sys;
-        sys = popen(cmd, "r");
-        char line[BUFLEN] = {0,};
-
-        // Get the operating system information
-        while(fgets(line, BUFLEN, sys) != NULL) {
-            strcat(returnBuffer, line);
-        }
+        snprintf(builtBy, sizeof(builtBy), "up to date");
+    }
+    
+    unlockFile(lockFd);
+    
+    // A memoized progname replays an earlier run with the same binary, inputs and
+    // arguments. Output handed straight to a local client never passes through here to keep,
+    // and streamed stdin isn't known until the program has read it.
+    long memoTtl, memoMax;
+    char memoHash[HASH_HEX_LEN + 1] = {0, };
+    char memoTemp[BUFLEN] = {0, };
+    int memoFd = -1;
+    
+    if (readMemoSettings(tempDirBuffer, &memoTtl, &memoMax) && !(localFile && isLocalClient(ClientSocket)) && streamed == 0 &&
+        memoKey(tempDirBuffer, argv, memoHash)) {
+        int status;
+        long age;
         
-        // Error checking
-        if (tempDirBuffer[0] == 0) {
-            printf("Empty return\n");
+        if (replayMemo(&resp, tempDirBuffer, memoHash, memoTtl, &status, &age)) {
+            statAdd(&Stats->memoHits, 1);
+            chdir("..");
+            respInfo(&resp, "\n[memoized] output of a run %lds ago\n", age);
+            respExitStatus(&resp, status);
+            respInfo(&resp, "Build: %s\n", builtBy);
+            respCompressionStats(&resp);
+            respInfo(&resp, "Took: %lums\n", calcTDiff(start));
+            respEnd(&resp);
+            return;
         }
         
-        fclose(sys);
-        
-        // Exit directory
+        statAdd(&Stats->memoMisses, 1);
+        memoFd = startMemo(tempDirBuffer, memoTemp, BUFLEN);
+    }
+    
+    struct timespec runStart;
+    clock_gettime(CLOCK_REALTIME, &runStart);
+    
+    // Launch through the zygote with stdout and stderr on one pipe
+    int outPipe[2];
+    if (pipe(outPipe) < 0) {
         chdir("..");
-        
-        snprintf(responseTime, 63, "\nTook: %lums\n", calcTDiff(start));
-        strcat(returnBuffer, "\n");
-        strcat(returnBuffer, responseTime);
-        send_to_client(ClientSocket, returnBuffer, BUFLEN);
+        respInfo(&resp, "%s\n", strerror(errno));
+        respEnd(&resp);
+        return;
+    }
+    
+    int replyFd;
+    statAdd(&Stats->activePrograms, 1);
+    pid_t pid = spawnProgram(tempDirBuffer, argv, outPipe[1], StdinPipe, &replyFd);
+    close(outPipe[1]);
+    if (StdinPipe >= 0) {
+        close(StdinPipe);
+        StdinPipe = -1;
+    }
+    
+    struct timespec spawned;
+    clock_gettime(CLOCK_REALTIME, &spawned);
+    traceSpan("spawn", &runStart, &spawned, argv[0]);
+    
+    long outputLen = 0;
+    if (localFile && isLocalClient(ClientSocket)) {
+        // Hand the output pipe to the local client to write to its file itself,
+        // the rest of the response follows once the program exits
+        respSendFd(&resp, outPipe[0]);
+    } else {
+        if (Tracing) {
+            // Wait for the program's first output (or for it to exit) to trace it
+            struct pollfd output = {outPipe[0], POLLIN, 0};
+            while (poll(&output, 1, -1) < 0 && errno == EINTR);
+            traceSince("first output byte", &spawned, NULL);
+        }
+        outputLen = respCopyFd(&resp, FRAME_DATA, outPipe[0], memoFd, MEMO_MAX_ENTRY);
     }
+    close(outPipe[0]);
+    
+    int status = waitProgram(pid, replyFd);
+    statAdd(&Stats->activePrograms, -1);
+    long runTimeUs = calcTDiffUs(runStart);
+    traceSince("exec", &spawned, NULL);
+    
+    if (memoFd >= 0) {
+        finishMemo(memoFd, memoTemp, tempDirBuffer, memoHash, status, outputLen, memoMax);
+    }
+    
+    // Exit directory
+    chdir("..");
+    
+    recordRunTime(tempDirBuffer, plan.key, runTimeUs);
+    if (strcmp(plan.key, "pgo-training") == 0) {
+        // Once trained the next run's stamp no longer matches and it rebuilds with the profile
+        plan.pgo.runs += 1;
+        writePgoState(tempDirBuffer, &plan.pgo);
+    }
+    
+    respInfo(&resp, "\n");
+    respExitStatus(&resp, status);
+    respInfo(&resp, "Build: %s\n", builtBy);
+    respInfo(&resp, "Run: %ldms\n", runTimeUs / 1000);
+    describeProfile(&resp, tempDirBuffer, plan.key, &plan.pgo);
+    respCompressionStats(&resp);
+    respInfo(&resp, "Took: %lums\n", calcTDiff(start));
+    respEnd(&resp);
     
     return;
 }
@@ -597,8 +4853,18 @@ void handle_request(int ClientSocket) {
     char ** commands;
     
     while (1) {
+        struct timespec recvStart, parseStart, parsed, queued;
+        
+        // Wait for the command first so the recv span is just the recv
+        struct pollfd readable = {ClientSocket, POLLIN, 0};
+        while (poll(&readable, 1, -1) < 0 && errno == EINTR);
         
+        clock_gettime(CLOCK_REALTIME, &recvStart);
         iResult = (int) recv(ClientSocket, recvbuf, recvbuflen, 0);
+        clock_gettime(CLOCK_REALTIME, &parseStart);
+        if (iResult > 0) {
+            statAdd(&Stats->bytesReceived, iResult);
+        }
         printf("recvBuf:%s", recvbuf);
         
         if (iResult > 0) {
@@ -607,15 +4873,63 @@ void handle_request(int ClientSocket) {
             char recvbufCopy[BUFLEN];
             strcpy(recvbufCopy, recvbuf);
             commands = separateCommands(recvbuf, &k);
+            clock_gettime(CLOCK_REALTIME, &parsed);
+            
+            int command = commandIndex(commands[0]);
+            statAdd(&Stats->inFlight, 1);
+            
+            // A run's streamed stdin follows it on the connection
+            int noOptions = k, localFile;
+            int streamsStdin = strcmp(commands[0], "run") == 0 && runClientOptions(commands, &noOptions, &localFile);
+            
+            TraceRequest = statAdd(&Stats->requests, 1);
+            Tracing = traceSampled(TraceRequest);
+            traceSpan("recv", &recvStart, &parseStart, NULL);
+            traceSpan("parse", &parseStart, &parsed, commands[0]);
+            
+            // Compression is reported per command
+            memset(&Compression, 0, sizeof(Compression));
             
             if (strcmp(commands[0], "put") == 0) {
                 printf("Running put command\n");
-                putCmd(ClientSocket, commands, k);
+                traceCommandStart("put");
+                startInProcess(command, &recvStart);
+                finishInProcess(putCmd(ClientSocket, commands, k));
+                traceCommandEnd();
+            } else if (strcmp(commands[0], "blob") == 0) {
+                traceCommandStart("blob");
+                startInProcess(command, &recvStart);
+                finishInProcess(blobCmd(ClientSocket, commands, k));
+                traceCommandEnd();
+            } else if (strcmp(commands[0], "sync") == 0) {
+                printf("Running sync command\n");
+                traceCommandStart("sync");
+                startInProcess(command, &recvStart);
+                finishInProcess(syncCmd(ClientSocket, commands, k));
+                traceCommandEnd();
+            } else if (strcmp(commands[0], "hello") == 0) {
+                helloCmd(ClientSocket, commands, k);
+                recordRequest(command, OUTCOME_OK, &recvStart);
             } else {
                 
                 pid_t pid;
+                sigset_t childSignal, previousMask;
+                clock_gettime(CLOCK_REALTIME, &queued);
+                
+                // Held back until the child is in Pending
+                sigemptyset(&childSignal);
+                sigaddset(&childSignal, SIGCHLD);
+                sigprocmask(SIG_BLOCK, &childSignal, &previousMask);
                 
                 if ((pid = fork()) == 0) {
+                    // Commands reap their own children with pclose
+                    signal(SIGCHLD, SIG_DFL);
+                    sigprocmask(SIG_SETMASK, &previousMask, NULL);
+                    ProcessBuffered = 0;
+                    
+                    // Traced when the command exits
+                    traceSince("queue", &queued, NULL);
+                    traceCommandStart(commands[0]);
                     printf("Running new process child for query\n");
                     printf("Bytes received: %d\n", iResult);
                     printf("got from client:%s\n", recvbufCopy);
@@ -628,9 +4942,17 @@ void handle_request(int ClientSocket) {
                     else if (strcmp(commands[0], "run") == 0) {
                         printf("Running run command\n");
                         runCmd(ClientSocket, commands, k);
+                        finishStdin();
+                        exit(0);
                     }
                     else if (strcmp(commands[0], "get") == 0) {
                         getCmd(ClientSocket, commands, k);
+                        exit(0);
+                    }
+                    else if (strcmp(commands[0], "profile") == 0) {
+                        printf("Running profile command\n");
+                        profileCmd(ClientSocket, commands, k);
+                        exit(0);
                     }
                     else if (strcmp(commands[0], "list") == 0) {
                         // Check if a correct number of commands are passed
@@ -641,21 +4963,50 @@ void handle_request(int ClientSocket) {
                         }
                         else {
                             printf("list usage: \"list [-l] directory\"\n");
-                            //send_to_client(ClientSocket, "malformed list has reached the server", 38);
+                            send_to_client(ClientSocket, "list usage: \"list [-l] directory\"\n");
                             exit(1);
                         }
 
                     }
+                    else if (strcmp(commands[0], "memo") == 0) {
+                        memoCmd(ClientSocket, commands, k);
+                        exit(0);
+                    }
+                    else if (strcmp(commands[0], "trace") == 0) {
+                        traceCmd(ClientSocket, commands, k);
+                        exit(0);
+                    }
+                    else if (strcmp(commands[0], "stats") == 0) {
+                        statsCmd(ClientSocket);
+                        exit(0);
+                    }
                     else if (strcmp(commands[0], "sys") == 0) {
                         printf("Running sys command\n");
                         sysCmd(ClientSocket);
                         exit(0);
                     }
+                    else {
+                        printf("Unknown command %s\n", commands[0]);
+                        send_to_client(ClientSocket, "Unknown command\n");
+                        exit(1);
+                    }
                         
                 }
                 else if (pid < 0) {
                     perror("Handle request fork failed with error");
+                    recordRequest(command, OUTCOME_ERROR, &recvStart);
+                } else {
+                    trackCommand(pid, command, &recvStart);
+                    
+                    // The connection is the run's until its stdin is through
+                    if (streamsStdin) {
+                        int stat;
+                        if (waitpid(pid, &stat, 0) == pid) {
+                            commandFinished(pid, stat);
+                        }
+                    }
                 }
+                sigprocmask(SIG_SETMASK, &previousMask, NULL);
                 
             }
             
@@ -676,11 +5027,29 @@ void handle_request(int ClientSocket) {
         }
         
         memset(recvbuf, 0, BUFLEN);
+        Tracing = 0;
+        TraceRequest = 0;
         signal(SIGCHLD, sig_child);
     };
 
 }
 
+// Formats a client address as "host : port"
+void describeAddress(struct sockaddr_storage *address, socklen_t len, char *out, int outLen) {
+    char host[NI_MAXHOST] = {0, };
+    char port[NI_MAXSERV] = {0, };
+    
+    if (address->ss_family == AF_UNIX) {
+        snprintf(out, outLen, "local socket");
+        return;
+    }
+    if (getnameinfo((struct sockaddr *) address, len, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        snprintf(out, outLen, "unknown");
+        return;
+    }
+    snprintf(out, outLen, "%s : %s", host, port);
+}
+
 void manageConnections(int ListenSocket) {
     int ClientSocket;
 
@@ -691,54 +5060,465 @@ void manageConnections(int ListenSocket) {
     */
     
     pid_t pid;
-    struct sockaddr_in NewAddress;
-    socklen_t addr_size = sizeof(NewAddress);
+    struct sockaddr_storage NewAddress;
+    socklen_t addr_size;
+    char clientName[BUFLEN] = {0, };
+    
+    // Wait on the tcp socket and the unix domain socket if there is one
+    struct pollfd listeners[2] = {{ListenSocket, POLLIN, 0}, {UnixListenSocket, POLLIN, 0}};
+    int noListeners = UnixListenSocket >= 0 ? 2 : 1;
+    
+    // Reap the client processes
+    signal(SIGCHLD, sig_child);
     
     while (1) {
-        // Accept new clients
-        ClientSocket = accept(ListenSocket, (struct sockaddr *)&NewAddress , &addr_size);
-        
-        if (ClientSocket < 0) {
+        if (poll(listeners, noListeners, -1) < 0) {
             // Handle error where signal is caught
-            if (errno == EINTR) {
-                continue;
-            }
-            else {
-                perror("Client accept failed");
-                close(ClientSocket);
+            if (errno != EINTR) {
+                perror("Poll failed with error");
             }
+            continue;
         }
-        printf("New Client Accepted from %s : %d\n", inet_ntoa(NewAddress.sin_addr), ntohs(NewAddress.sin_port));
-        if ((pid = fork()) == 0) {
-            close(ListenSocket);
+        
+        for (int i = 0; i < noListeners; i++) {
+            if ((listeners[i].revents & POLLIN) == 0) {
+                continue;
+            }
             
-            // Infinite loops that allows client to enter commands
-            handle_request(ClientSocket);
+            // Accept new clients
+            struct timespec acceptStart;
+            clock_gettime(CLOCK_REALTIME, &acceptStart);
+            addr_size = sizeof(NewAddress);
+            ClientSocket = accept(listeners[i].fd, (struct sockaddr *)&NewAddress , &addr_size);
             
-            printf("Disconnected from %s : %d\n", inet_ntoa(NewAddress.sin_addr), ntohs(NewAddress.sin_port));
-            exit(0);
+            if (ClientSocket < 0) {
+                // Signals and other workers taking the unix client aren't errors
+                if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("Client accept failed");
+                }
+                continue;
+            }
+            describeAddress(&NewAddress, addr_size, clientName, BUFLEN);
+            printf("New Client Accepted from %s\n", clientName);
+            if ((pid = fork()) == 0) {
+                close(ListenSocket);
+                if (UnixListenSocket >= 0) {
+                    close(UnixListenSocket);
+                }
+                
+                // Counted until this process exits, see statsRelease
+                ConnectionPid = getpid();
+                statAdd(&Stats->connections, 1);
+                TraceConnection = statAdd(&Stats->totalConnections, 1);
+                
+                // Accepting takes in the fork of this process
+                Tracing = traceSampled(TraceConnection);
+                traceSince("accept", &acceptStart, clientName);
+                Tracing = 0;
+                
+                // Infinite loops that allows client to enter commands
+                handle_request(ClientSocket);
+                
+                printf("Disconnected from %s\n", clientName);
+                exit(0);
+            }
+            else if (pid < 0) {
+                perror("Fork failed with error");
+            }
+            close(ClientSocket);
         }
-        else if (pid < 0) {
-            perror("Fork failed with error");
+    }
+    
+}
+
+// Runs one acceptor, pinned to a cpu if asked
+void runWorker(int worker) {
+#ifdef __linux__
+    if (Config.pinCpus) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            perror("Unable to pin worker");
+        }
+    }
+#endif
+    
+    int ListenSocket = serverStartup();
+    manageConnections(ListenSocket);
+}
+
+// Forks a worker process, returns its pid
+pid_t forkWorker(int worker) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        runWorker(worker);
+        exit(0);
+    } else if (pid < 0) {
+        perror("Worker fork failed with error");
+    }
+    return pid;
+}
+
+pid_t *Workers = NULL;
+
+// Takes the workers down with the supervisor
+void sig_stop(int signum) {
+    for (int i = 0; i < Config.workers; i++) {
+        if (Workers[i] > 0) {
+            kill(Workers[i], SIGTERM);
+        }
+    }
+    _exit(0);
+}
+
+// Starts the workers and restarts any that die
+void superviseWorkers(void) {
+    pid_t *workers = calloc(Config.workers, sizeof(pid_t));
+    
+    Workers = workers;
+    signal(SIGTERM, sig_stop);
+    signal(SIGINT, sig_stop);
+    
+    for (int i = 0; i < Config.workers; i++) {
+        workers[i] = forkWorker(i);
+    }
+    printf("Started %d workers\n", Config.workers);
+    
+    while (1) {
+        int stat;
+        pid_t pid = wait(&stat);
+        
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait failed with error");
+            exit(1);
         }
-        close(ClientSocket);
         
+        for (int i = 0; i < Config.workers; i++) {
+            if (workers[i] == pid) {
+                printf("worker %d (%d) terminated, restarting\n", i, pid);
+                workers[i] = forkWorker(i);
+            }
+        }
+    }
+}
+
+// Appends to a metrics page, which stops growing once it's full
+void metricsAppend(char *page, int *len, const char *format, ...) {
+    va_list args;
+    
+    if (*len >= METRICS_MAX_LEN - 1) {
+        return;
+    }
+    va_start(args, format);
+    int n = vsnprintf(page + *len, METRICS_MAX_LEN - *len, format, args);
+    va_end(args);
+    *len = n < METRICS_MAX_LEN - *len ? *len + n : METRICS_MAX_LEN - 1;
+}
+
+// Appends a metric without labels along with its help and type
+void metricsValue(char *page, int *len, const char *name, const char *type, const char *help, long value) {
+    metricsAppend(page, len, "# HELP %s %s\n# TYPE %s %s\n%s %ld\n", name, help, name, type, name, value);
+}
+
+// Writes out the shared counters in Prometheus text format, returns the length
+int renderMetrics(char *page) {
+    int len = 0;
+    
+    metricsValue(page, &len, "rexec_connections", "gauge", "Client connections open", statLoad(&Stats->connections));
+    metricsValue(page, &len, "rexec_connections_total", "counter", "Client connections accepted", statLoad(&Stats->totalConnections));
+    
+    metricsAppend(page, &len, "# HELP rexec_requests_total Requests finished by command and outcome\n# TYPE rexec_requests_total counter\n");
+    for (int i = 0; i < NO_COMMANDS; i++) {
+        for (int j = 0; j < NO_OUTCOMES; j++) {
+            metricsAppend(page, &len, "rexec_requests_total{command=\"%s\",outcome=\"%s\"} %ld\n",
+                          commandNames[i], outcomeNames[j], statLoad(&Stats->requestsBy[i][j]));
+        }
+    }
+    
+    metricsAppend(page, &len, "# HELP rexec_request_duration_seconds Time from receiving a request to finishing it\n# TYPE rexec_request_duration_seconds histogram\n");
+    for (int i = 0; i < NO_COMMANDS; i++) {
+        long count = 0;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+            count += statLoad(&Stats->latency[i][bucket]);
+            if (bucket < LATENCY_BUCKETS - 1) {
+                metricsAppend(page, &len, "rexec_request_duration_seconds_bucket{command=\"%s\",le=\"%g\"} %ld\n",
+                              commandNames[i], latencyBounds[bucket] / 1e6, count);
+            } else {
+                metricsAppend(page, &len, "rexec_request_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %ld\n", commandNames[i], count);
+            }
+        }
+        metricsAppend(page, &len, "rexec_request_duration_seconds_sum{command=\"%s\"} %.6f\n", commandNames[i], statLoad(&Stats->latencyUs[i]) / 1e6);
+        metricsAppend(page, &len, "rexec_request_duration_seconds_count{command=\"%s\"} %ld\n", commandNames[i], count);
+    }
+    
+    metricsValue(page, &len, "rexec_requests_in_flight", "gauge", "Requests received and not finished", statLoad(&Stats->inFlight));
+    metricsValue(page, &len, "rexec_active_children", "gauge", "Command processes running", statLoad(&Stats->activeChildren));
+    metricsValue(page, &len, "rexec_active_programs", "gauge", "Programs started by run and still running", statLoad(&Stats->activePrograms));
+    metricsValue(page, &len, "rexec_queue_depth", "gauge", "Runs waiting for a build of their progname to finish", statLoad(&Stats->buildWaiting));
+    metricsValue(page, &len, "rexec_active_builds", "gauge", "Builds compiling and sharing the build jobs", statLoad(&Stats->activeBuilds));
+    metricsValue(page, &len, "rexec_build_cache_hits_total", "counter", "Runs that found main already built", statLoad(&Stats->buildHits));
+    metricsValue(page, &len, "rexec_build_cache_misses_total", "counter", "Runs that had to compile", statLoad(&Stats->buildMisses));
+    metricsValue(page, &len, "rexec_memo_hits_total", "counter", "Runs answered with a memoized result", statLoad(&Stats->memoHits));
+    metricsValue(page, &len, "rexec_memo_misses_total", "counter", "Runs of memoized prognames that had to run", statLoad(&Stats->memoMisses));
+    metricsValue(page, &len, "rexec_sent_bytes_total", "counter", "Bytes sent to clients", statLoad(&Stats->bytesSent));
+    metricsValue(page, &len, "rexec_received_bytes_total", "counter", "Bytes received from clients", statLoad(&Stats->bytesReceived));
+    metricsValue(page, &len, "rexec_buffered_bytes", "gauge", "Reply bytes buffered and not yet sent", statLoad(&Stats->buffered));
+    metricsValue(page, &len, "rexec_stalled_connections", "gauge", "Clients not taking data right now", statLoad(&Stats->stalled));
+    metricsValue(page, &len, "rexec_stalls_total", "counter", "Times a client stopped taking data", statLoad(&Stats->stalls));
+    metricsValue(page, &len, "rexec_evictions_total", "counter", "Clients dropped for not taking data", statLoad(&Stats->evictions));
+    
+    return len;
+}
+
+// Answers one scrape, anything but GET /metrics gets a 404
+void serveMetrics(int sock) {
+    static char page[METRICS_MAX_LEN];
+    char request[1024] = {0, };
+    char header[256];
+    struct timeval timeout = {1, 0};
+    
+    // A scraper that stalls mustn't hold up the next one
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    if (recv(sock, request, sizeof(request) - 1, 0) <= 0) {
+        return;
     }
     
+    int len = 0;
+    const char *status = "404 Not Found";
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+        status = "200 OK";
+        len = renderMetrics(page);
+    }
+    
+    int headerLen = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %d\r\nConnection: close\r\n\r\n", status, len);
+    struct iovec iov[2] = {{header, headerLen}, {page, len}};
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sendmsg(sock, &msg, MSG_NOSIGNAL);
 }
 
-int main(int argc, const char * argv[]) {
-    struct sockaddr_in Address = {0};
+// Serves metrics one scrape at a time until the server goes
+void metricsLoop(int ListenSocket, pid_t serverPid) {
+    struct pollfd listener = {ListenSocket, POLLIN, 0};
+    
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    if (ZygoteSocket >= 0) {
+        close(ZygoteSocket);
+    }
+    
+    while (getppid() == serverPid) {
+        if (poll(&listener, 1, 1000) <= 0) {
+            continue;
+        }
+        int sock = accept(ListenSocket, NULL, NULL);
+        if (sock >= 0) {
+            serveMetrics(sock);
+            close(sock);
+        }
+    }
+    exit(0);
+}
 
-    // Specify server struct variables
-    Address.sin_family = AF_INET;
-    Address.sin_port = htons(PORT);
-    //Address.sin_addr.s_addr = INADDR_ANY;
-    inet_aton("127.0.0.1", &Address.sin_addr);
+// Starts the process serving metrics on the loopback port given with -m
+void metricsStartup(void) {
+    struct sockaddr_in address = {0};
+    int on = 1;
+    pid_t serverPid = getpid();
+    
+    address.sin_family = AF_INET;
+    address.sin_port = htons(Config.metricsPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    int ListenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (ListenSocket < 0) {
+        perror("Metrics socket failed with error");
+        exit(1);
+    }
+    setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(ListenSocket, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(ListenSocket, 16) < 0) {
+        perror("Metrics listener failed with error");
+        exit(1);
+    }
+    setCloseOnExec(ListenSocket);
     
-    int ListenSocket = serverStartup(Address);
+    pid_t pid = fork();
+    if (pid == 0) {
+        metricsLoop(ListenSocket, serverPid);
+    } else if (pid < 0) {
+        perror("Metrics fork failed with error");
+    }
+    close(ListenSocket);
+    printf("Metrics on http://127.0.0.1:%d/metrics\n", Config.metricsPort);
+}
 
-    manageConnections(ListenSocket);
+// Parses optarg as a whole number within min and max, 0 if it isn't one
+int parseNumber(const char *text, long min, long max, long *value) {
+    char *end;
+    
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return end != text && *end == '\0' && errno == 0 && *value >= min && *value <= max;
+}
+
+void usage(const char *name) {
+    printf("usage: %s [-a address] [-p port] [-6] [-w workers] [-c] [-u socket-path]\n", name);
+    printf("       [-b bytes] [-B bytes] [-s seconds] [-e never|stalled|pressure] [-t trace-file] [-m port] [-j jobs]\n");
+    printf("  -a  address to listen on (default %s, %s with -6)\n", ADDRESS, ADDRESS6);
+    printf("  -p  port to listen on (default %d)\n", PORT);
+    printf("  -6  dual stack ipv6 listener that also accepts ipv4 clients\n");
+    printf("  -w  acceptor processes sharing the port with SO_REUSEPORT, 0 for one per core (default 1)\n");
+    printf("  -c  pin each acceptor to its own cpu\n");
+    printf("  -u  also listen on a unix domain socket, local clients get file descriptors passed to them\n");
+    printf("  -b  bytes of reply data buffered per connection before it is sent (default %d)\n", CONN_BUDGET);
+    printf("  -B  bytes of reply data buffered across all connections (default %ld)\n", GLOBAL_BUDGET);
+    printf("  -s  seconds a client can go without reading before it can be evicted (default %d)\n", STALL_TIMEOUT);
+    printf("  -e  eviction policy for stalled clients: never, stalled, or pressure to only evict\n");
+    printf("      when the global budget is nearly used up (default stalled)\n");
+    printf("  -t  trace requests to this file in Chrome trace event format, see the trace command\n");
+    printf("  -m  serve Prometheus metrics over http on this port of 127.0.0.1\n");
+    printf("  -j  compile jobs shared by the builds going at once, 0 for one per core (default 0)\n");
+}
+
+int main(int argc, char * argv[]) {
+    int opt;
+    int addressGiven = 0;
+    long value;
+    
+    while ((opt = getopt(argc, argv, "a:p:6w:cu:b:B:s:e:t:m:j:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                snprintf(Config.address, sizeof(Config.address), "%s", optarg);
+                addressGiven = 1;
+                break;
+            case 'p':
+                if (!parseNumber(optarg, 1, 65535, &value)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                Config.port = (int) value;
+                break;
+            case '6':
+                Config.ipv6 = 1;
+                break;
+            case 'w':
+                if (!parseNumber(optarg, 0, 4096, &value)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                Config.workers = (int) value;
+                break;
+            case 'c':
+                Config.pinCpus = 1;
+                break;
+            case 'u':
+                snprintf(Config.unixPath, sizeof(Config.unixPath), "%s", optarg);
+                break;
+            case 'b':
+                if (!parseNumber(optarg, 1, LONG_MAX, &value)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                Config.connBudget = value;
+                break;
+            case 'B':
+                if (!parseNumber(optarg, 1, LONG_MAX, &value)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                Config.globalBudget = value;
+                break;
+            case 's':
+                if (!parseNumber(optarg, 1, INT_MAX, &value)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                Config.stallTimeout = (int) value;
+                break;
+            case 'm':
+                if (!parseNumber(optarg, 1, 65535, &value)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                Config.metricsPort = (int) value;
+                break;
+            case 'j':
+                if (!parseNumber(optarg, 0, 4096, &value)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                Config.buildJobs = (int) value;
+                break;
+            case 't':
+                snprintf(Config.tracePath, sizeof(Config.tracePath), "%s", optarg);
+                break;
+            case 'e':
+                Config.evictPolicy = -1;
+                for (int i = EVICT_NEVER; i <= EVICT_PRESSURE; i++) {
+                    if (strcmp(optarg, evictNames[i]) == 0) {
+                        Config.evictPolicy = i;
+                    }
+                }
+                if (Config.evictPolicy < 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    
+    if (Config.ipv6 && addressGiven == 0) {
+        strcpy(Config.address, ADDRESS6);
+    }
+    if (Config.workers <= 0) {
+        Config.workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (Config.buildJobs <= 0) {
+        Config.buildJobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // A reply always gets at least a segment, whatever the budgets
+    if (Config.connBudget < SEGMENT_LEN) {
+        Config.connBudget = SEGMENT_LEN;
+    }
+    if (Config.globalBudget < Config.connBudget) {
+        Config.globalBudget = Config.connBudget;
+    }
+
+    // Before anything else so the zygote is forked from a small process
+    zygoteStartup();
+    
+    statsStartup();
+    if (Config.tracePath[0] != '\0') {
+        traceStartup();
+    }
+    if (Config.metricsPort > 0) {
+        metricsStartup();
+    }
+    blobStartup();
+    
+    if (Config.unixPath[0] != '\0') {
+        UnixListenSocket = unixStartup();
+    }
+    
+    if (Config.workers == 1) {
+        runWorker(0);
+    } else {
+        superviseWorkers();
+    }
     
     return 0;
 }